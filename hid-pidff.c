@@ -27,6 +27,18 @@
 #include <linux/hid.h>
 
 #include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/moduleparam.h>
 
 #include "usbhid.h"
 
@@ -153,7 +165,10 @@ static const u8 pidff_pool_move[] = { 0x86, 0x87, 0x88 };
 
 #define PID_ENABLE_ACTUATORS	0
 #define PID_RESET		1
-static const u8 pidff_device_control[] = { 0x97, 0x9a };
+#define PID_DEVICE_PAUSE	2
+#define PID_STOP_ALL_EFFECTS	3
+#define PID_DEVICE_CONTINUE	4
+static const u8 pidff_device_control[] = { 0x97, 0x9a, 0x98, 0x99, 0x9b };
 
 #define PID_CONSTANT	0
 #define PID_RAMP	1
@@ -175,37 +190,207 @@ static const u8 pidff_effect_types[] = {
 #define PID_BLOCK_LOAD_FULL	1
 static const u8 pidff_block_load_status[] = { 0x8c, 0x8d };
 
+/* Block load polling. The timeout adapts to the observed creation time. */
+#define PID_BLOCK_LOAD_TIMEOUT_MIN	10000	/* us */
+#define PID_BLOCK_LOAD_TIMEOUT_MAX	500000	/* us */
+#define PID_BLOCK_LOAD_BACKOFF_MAX	8000	/* us */
+#define PID_BLOCK_LOAD_POLL_BUCKETS	5	/* 1, 2, 3, 4, more polls */
+#define PID_BLOCK_LOAD_TIME_BUCKETS	8	/* < 250 us, doubling */
+#define PID_BLOCK_LOAD_SAMPLES		4	/* Timed loads before adapting */
+#define PID_BLOCK_LOAD_RETRIES		60	/* Polls until then */
+
+/* Erases arriving within this many ms are freed in the device together */
+#define PID_ERASE_DELAY		10
+
+/* Report images kept per effect: set effect and parameter blocks 1.. */
+#define PID_IMAGES		(1 + PID_AXES_MAX)
+
+/* Output scheduling */
+#define PID_SCHED_SIZE		256	/* Parameter reports queued in the driver */
+#define PID_SCHED_DEPTH		4	/* Reports let into the usbhid queue */
+
+/* Probe steps, timed separately */
+#define PID_PROBE_LAYOUT	0
+#define PID_PROBE_RESET		1
+#define PID_PROBE_POOL		2
+#define PID_PROBE_AUTOCENTER	3
+#define PID_PROBE_STEPS		4
+static const char * const pidff_probe_steps[] = {
+	"layout", "reset", "pool", "autocenter"
+};
+
 #define PID_EFFECT_START	0
 #define PID_EFFECT_STOP		1
 static const u8 pidff_effect_operation_status[] = { 0x79, 0x7b };
 
+/* Placement policies of the driver managed memory pool */
+#define PID_POOL_FIRST_FIT	0
+#define PID_POOL_BEST_FIT	1
+
+static int pidff_pool_policy = PID_POOL_FIRST_FIT;
+module_param_named(pool_policy, pidff_pool_policy, int, 0644);
+MODULE_PARM_DESC(pool_policy,
+	"Driver managed pool placement: 0 = first fit (default), 1 = best fit");
+
+static bool pidff_pool_slabs = true;
+module_param_named(pool_slabs, pidff_pool_slabs, bool, 0644);
+MODULE_PARM_DESC(pool_slabs,
+	"Group same sized parameter blocks into regions of the pool (default on)");
+
+static bool pidff_pool_share = true;
+module_param_named(pool_share, pidff_pool_share, bool, 0644);
+MODULE_PARM_DESC(pool_share,
+	"Share identical parameter blocks between effects (default on)");
+
+static unsigned int pidff_virtual_effects;
+module_param_named(virtual_effects, pidff_virtual_effects, uint, 0444);
+MODULE_PARM_DESC(virtual_effects,
+	"Effect slots offered to applications, swapped in and out of the device on demand (default 0 = device slots only, max 96)");
+
+static bool pidff_lazy_upload;
+module_param_named(lazy_upload, pidff_lazy_upload, bool, 0644);
+MODULE_PARM_DESC(lazy_upload,
+	"Load effects into the device on first playback instead of on upload (default off)");
+
+static bool pidff_coalesce;
+module_param_named(coalesce, pidff_coalesce, bool, 0644);
+MODULE_PARM_DESC(coalesce,
+	"Hold back effect updates while output reports are queued, sending only the latest (default off)");
+
+static bool pidff_stream;
+module_param_named(stream, pidff_stream, bool, 0444);
+MODULE_PARM_DESC(stream,
+	"Send constant levels and periodic offsets once per output polling interval (default off)");
+
+static bool pidff_async;
+module_param_named(async, pidff_async, bool, 0444);
+MODULE_PARM_DESC(async,
+	"Return from effect upload before talking to the device (default off)");
+
+static bool pidff_retype;
+module_param_named(retype, pidff_retype, bool, 0644);
+MODULE_PARM_DESC(retype,
+	"Reuse erased device effects of another type with the same parameter blocks (default off)");
+
 /* Flags to indicate capabilities of the device */
 
 #define PID_SUPPORTS_DEVICE_MANAGED		1
 #define PID_SUPPORTS_POOL_MOVE			2
 
+/*
+ * Rescaling of input values to a field, as 32.32 fixed point factors
+ * computed once per field. 0 if the field range does not allow it.
+ */
+#define PID_SCALE_FULL		0	/* 0..0xffff to the field range */
+#define PID_SCALE_POSITIVE	1	/* 0..0x7fff to the field range */
+#define PID_SCALE_NEGATIVE	2	/* 0..0x8000 to the field range */
+#define PID_SCALE_SIGNED	3	/* 0..0x7fff to 0..logical maximum */
+#define PID_SCALE_COUNT		4
+
 struct pidff_usage {
 	struct hid_field *field;
 	s32 *value;
+	u64 scale[PID_SCALE_COUNT];
+};
+
+/* Block index of blocks not owned by any effect */
+#define PID_BLOCK_INDEX_NONE	0xff
+
+/* Memory block types */
+#define PID_BLOCK_GENERAL	0	/* Block in the general pool */
+#define PID_BLOCK_REGION	1	/* Pool block holding slab slots */
+#define PID_BLOCK_SLOT		2	/* Slot within a slab region */
+
+/* Slab classes, one per parameter block report starting at SET_ENVELOPE */
+#define PID_SLAB_CLASSES	5
+#define PID_SLAB_NONE		0xff
+#define PID_SLAB_SLOTS		8
+static const char * const pidff_slab_names[] = {
+	"envelope", "condition", "periodic", "constant", "ramp"
 };
 
+/* Values of the largest parameter block report, without the offset */
+#define PID_PAYLOAD_MAX		(sizeof(pidff_set_condition) - 1)
+
 struct pidff_memory_block {
-	unsigned int block_index;	/* Effect block index */
-	unsigned int block_offset;	/* Effect block offset */
-	unsigned int size;		/* Block size (reserved memory) */
+	u16 block_offset;		/* Effect block offset */
+	u16 size;			/* Block size (reserved memory) */
+	u16 gap;			/* Free memory after this block */
+	u16 subtree_gap;		/* Largest gap in the offset subtree */
+	u8 block_index;			/* Effect block index */
 	u8 offset_num;
 
+	u8 refcount;			/* Effects using the block */
+	u8 report;			/* Parameter report stored in the block */
+	u32 hash;			/* Hash of the payload */
+	s32 payload[PID_PAYLOAD_MAX];	/* Encoded report values */
+	struct hlist_node hash_node;	/* Shared block index */
+
+	u8 type;			/* PID_BLOCK_* */
+	u8 slab;			/* Slab class or PID_SLAB_NONE */
+	u8 slab_slot;			/* Slot number within the region */
+	u16 slab_used;			/* Used slots of a region */
+	struct pidff_memory_block *region;	/* Region of a slot */
+	struct list_head slab_list;	/* Regions of the same class */
+
+	struct rb_node offset_node;	/* Blocks indexed by offset */
+	struct rb_node gap_node;	/* Non-zero gaps indexed by size */
 	struct list_head list;
 };
 
+struct pidff_slab {
+	struct list_head regions;
+	unsigned int nr_regions;
+	unsigned int slots_used;
+	unsigned int spilled;		/* Blocks placed in the general pool */
+};
+
+/* Output report waiting in the driver, its values are kept separately */
+struct pidff_sched_entry {
+	u8 report;
+	s16 pid;			/* Effect the report belongs to, or -1 */
+	ktime_t queued;
+};
+
+/* Last values sent with an output report, per block the report writes to */
+struct pidff_shadow {
+	s32 *values;			/* nr_values for each key */
+	unsigned long *valid;		/* Keys whose values are known */
+	unsigned int nr_keys, nr_values;
+	unsigned int elided;		/* Reports not sent as unchanged */
+};
+
 struct pidff_info {
 	int id;
 	int effect_type_id;
 	struct pidff_memory_block *offset[PID_AXES_MAX];
+	int relocated;			/* Blocks moved, set effect is stale */
+	int reload;			/* Blocks moved without their contents */
+	int playing;			/* Started and not explicitly stopped */
+	unsigned long play_until;	/* Jiffies when a finite effect ends */
+	struct ff_effect effect;	/* Last successfully uploaded effect */
+
+	int uploaded;			/* Effect exists in the input core */
+	int resident;			/* Effect is loaded into the device */
+	int swap_count;			/* Playback count waiting for swap in */
+	int reserved;			/* Holds a device slot for the swap in */
+	int reserved_id;		/* Id held in driver managed mode, or -1 */
+	unsigned long last_used;	/* Jiffies of the last upload or playback */
+
+	int update_pending;		/* update waits for the output queue */
+	struct ff_effect update;	/* Latest update not yet sent */
+	int stream_dirty;		/* stream waits for the stream timer */
+	struct ff_effect stream;	/* Latest streamed update */
+
+	u8 image_report[PID_IMAGES];	/* Report of each saved image */
+	unsigned long image_valid;	/* Images saved since the last load */
+	int image_ok;			/* Images make up the whole effect */
 };
 
 struct pidff_device {
 	struct hid_device *hid;
+	struct input_dev *input;
+	int (*flush)(struct input_dev *dev, struct file *file);
 
 	struct hid_report *reports[sizeof(pidff_reports)];
 	int report_size[sizeof(pidff_reports)];
@@ -236,6 +421,7 @@ struct pidff_device {
 	/* Special fields in set_effect */
 	struct hid_field *set_effect_type;
 	struct hid_field *effect_direction;
+	u64 direction_scale[PID_SCALE_COUNT];
 	struct hid_field *axes_enable;
 
 	/* Special field in device_control */
@@ -257,13 +443,111 @@ struct pidff_device {
 
 	unsigned long flags;
 
-	struct pidff_info effect[PID_EFFECTS_MAX];
+	/* Effects by input effect id. With virtual effects there are more of
+	 * them than the device has slots, the rest are kept on the host.
+	 */
+	struct pidff_info *effect;
+	int nr_effects;
 	struct pidff_info active;
 	int active_effect_id;
 
-	/* struct pidff_memory_block *memory; */
+	/* Protects effect residency and the effect operation report against
+	 * playback, which runs in atomic context
+	 */
+	spinlock_t lock;
+	struct workqueue_struct *wq;	/* Ordered, for all deferred work */
+	int dead;			/* Disconnected, nothing is queued */
+	struct work_struct swap_work;
+	DECLARE_BITMAP(swap_pending, FF_MAX_EFFECTS);
+	unsigned int swap_ins, evictions, deferred_uploads;
+	int nr_reserved;		/* Device slots held for async uploads */
+
+	/* Erased effects still to be freed in the device, by PID block index */
+	struct delayed_work erase_work;
+	DECLARE_BITMAP(erase_pending, PID_EFFECTS_MAX + 1);
+	u8 erase_layout[PID_EFFECTS_MAX + 1];	/* Of the tombstoned effects */
+	u8 erase_type[PID_EFFECTS_MAX + 1];
+	unsigned int revived;
+
+	/* Field values last sent for each effect, sched_nr_values each */
+	s32 *images;
+	unsigned int image_offset[PID_IMAGES];	/* Within those of an effect */
+	unsigned int image_stride;		/* Values of an effect */
+	int image_slot;			/* Effect the images are saved for */
+	unsigned int image_restores;
+	unsigned int async_uploads, deferred_erases, erase_batches;
+
+	/* Effect creation in device managed mode */
+	unsigned int block_load_avg_us, block_load_samples;
+	unsigned int block_load_polls[PID_BLOCK_LOAD_POLL_BUCKETS];
+	unsigned int block_load_us[PID_BLOCK_LOAD_TIME_BUCKETS];
+
+	/* Sends the latest held back effect updates */
+	struct delayed_work update_work;
+	unsigned int deferred_updates, coalesced_updates, fast_updates;
+
+	/* Streamed values sent once per output polling interval */
+	struct hrtimer stream_timer;
+	ktime_t stream_period;
+	int report_hold;		/* Reports built in process context */
+	unsigned int stream_frames, stream_skipped;
+	s64 stream_jitter_sum, stream_jitter_max;
+
+	/* Effect slot of each PID effect block index, -1 if unused */
+	s16 pid_slot[PID_EFFECTS_MAX + 1];
+	/* Block indexes in use, driver managed mode only */
+	DECLARE_BITMAP(pid_used, PID_EFFECTS_MAX);
+
+	/* Allocated blocks in offset order. The list always starts with
+	 * pool_head, a zero sized block at the beginning of the usable pool
+	 * which owns the gap in front of the first real block.
+	 */
 	struct list_head memory;
+	struct rb_root memory_by_offset;
+	struct rb_root memory_by_gap;
+	struct pidff_memory_block pool_head;
 	int alignment;
+
+	/* Preallocated blocks. Blocks below blocks_used that are not in use
+	 * are kept on the free_blocks index stack.
+	 */
+	struct pidff_memory_block *blocks;
+	u16 *free_blocks;
+	unsigned int nr_blocks, blocks_used, nr_free_blocks;
+
+	struct pidff_slab slab[PID_SLAB_CLASSES];
+
+	/* Parameter blocks indexed by their contents */
+	DECLARE_HASHTABLE(shared_blocks, 6);
+	unsigned int shared_hits;
+
+	struct pidff_shadow shadow[sizeof(pidff_reports)];
+
+	/* Parameter reports waiting for room in the usbhid queue. Control
+	 * reports go straight to usbhid, unless they start an effect with
+	 * reports still waiting here.
+	 */
+	spinlock_t sched_lock;
+	struct pidff_sched_entry *sched;
+	s32 *sched_values;
+	unsigned int sched_head, sched_tail, sched_nr_values;
+	u8 sched_pid[PID_EFFECTS_MAX + 1];	/* Waiting reports per effect */
+	struct delayed_work sched_work;
+	unsigned int control_sent, control_depth_sum, control_depth_max;
+	unsigned int bulk_queued, bulk_depth_max, bulk_overflows;
+	s64 bulk_wait_sum, bulk_wait_max;
+
+	u16 autocenter;			/* Last autocenter magnitude */
+
+	unsigned int restores, restored, restarted, restore_failures;
+	s64 restore_us, restore_max_us, restart_us;
+	unsigned int stop_all_sent, stops_elided;
+
+	s8 layout_autocenter;		/* Cached probe result, -1 if none */
+	s64 probe_us[PID_PROBE_STEPS];
+
+	struct dentry *debugfs;		/* Directory of the files below */
+	struct dentry *debugfs_stats;
 };
 
 /*
@@ -372,382 +656,1731 @@ static void pidff_report_sizes(struct pidff_device *pidff)
 	}
 }
 
+static void pidff_set_effect_report(struct pidff_device *pidff,
+				    struct ff_effect *effect);
+static int pidff_set_parameter_reports(struct pidff_device *pidff,
+				       struct ff_effect *effect);
+static int pidff_restore_effect(struct pidff_device *pidff, int slot,
+				int params);
+
 /*
- * Return a new free memory block offset. NULL on error.
+ * Round a block size up to the pool alignment of the device
  */
-static struct pidff_memory_block *pidff_allocate_memory_block(
-		struct pidff_device *pidff, int size)
+static unsigned int pidff_align(struct pidff_device *pidff, unsigned int size)
 {
-	struct pidff_memory_block *block, *new_block;
-	int offset, free_mem;
-
-	if (!size)
-		return NULL;
+	if (pidff->alignment <= 1)
+		return size;
 
-	/* Make sure alignment is as the device wants */
-	size += size % pidff->alignment;
+	return roundup(size, pidff->alignment);
+}
 
-	if (pidff->pid_total_ram < (pidff->pid_used_ram + size))
-		return NULL;
+static u16 pidff_block_gap(struct pidff_memory_block *block)
+{
+	return block->gap;
+}
 
-	if (list_empty(&pidff->memory)) {
-		new_block = kzalloc(sizeof(*new_block),
-			GFP_KERNEL);
-		if (!new_block)
-			return NULL;
+RB_DECLARE_CALLBACKS_MAX(static, pidff_gap_callbacks,
+	struct pidff_memory_block, offset_node, u16, subtree_gap,
+	pidff_block_gap)
 
-		list_add(&new_block->list, &pidff->memory);
-
-		offset = pidff_report_store_size(pidff, PID_SET_EFFECT);
-		if (offset == 0) {
-			/* If SET_EFFECT report size is not defined, assume they
-			 * are not stored in pool and blocks can be stored at the
-			 * beginning of pool. However address 0 does not seem to
-			 * work so starting at first aligned offset.
-			 */
-			if(pidff->block_offset[0].field) {
-				offset = pidff->block_offset[0].field->logical_minimum;
-			} else {
-				offset = pidff->alignment;	/* This is a hack... */
-			}
-		} else {
-			/* If SET_EFFECT size was defined, assume they are stored
-			 * at the beginning of pool so the blocks must start after
-			 * the maximum amount of effects.
-			 */
-			offset += offset % pidff->alignment;
-			offset *= pidff->max_effects;
-		}
+/*
+ * Insert a block into the size ordered gap tree. Ties are broken by offset
+ * so that best fit prefers the lowest address.
+ */
+static void pidff_gap_insert(struct pidff_device *pidff,
+		struct pidff_memory_block *block)
+{
+	struct rb_node **link = &pidff->memory_by_gap.rb_node;
+	struct rb_node *parent = NULL;
+	struct pidff_memory_block *entry;
+
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct pidff_memory_block, gap_node);
+		if (block->gap < entry->gap ||
+			(block->gap == entry->gap &&
+			block->block_offset < entry->block_offset))
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
 
-		new_block->block_index = pidff->active.id;
-		new_block->block_offset = offset;
-		new_block->size = size;
+	rb_link_node(&block->gap_node, parent, link);
+	rb_insert_color(&block->gap_node, &pidff->memory_by_gap);
+}
 
-		pidff->pid_used_ram = offset + size;
-#ifdef DEBUG_MEM_ALLOC
-		hid_dbg(pidff->hid, "First block allocated at 0x%x, size %d, ram used %d\n",
-			new_block->block_offset, new_block->size,
-			pidff->pid_used_ram);
-#endif
-		return new_block;
+/*
+ * Change the amount of free memory following a block and update both indexes
+ */
+static void pidff_set_gap(struct pidff_device *pidff,
+		struct pidff_memory_block *block, unsigned int gap)
+{
+	if (!RB_EMPTY_NODE(&block->gap_node)) {
+		rb_erase(&block->gap_node, &pidff->memory_by_gap);
+		RB_CLEAR_NODE(&block->gap_node);
 	}
 
-	/* Try to find first large enough memory slot */
-	list_for_each_entry(block, &pidff->memory, list) {
-		if (!list_is_last(&block->list, &pidff->memory)) {
-			free_mem = list_next_entry(block, list)->block_offset -
-				block->block_offset - block->size;
+	block->gap = gap;
+	pidff_gap_callbacks.propagate(&block->offset_node, NULL);
 
-			/* Found large enough memory slot */
-			if (free_mem >= size) {
-				new_block = kzalloc(sizeof(*new_block),	GFP_KERNEL);
-				if (!new_block)
-					return NULL;
-
-				offset = block->block_offset + block->size;
-				new_block->block_index = pidff->active.id;
-				new_block->block_offset = offset;
-				new_block->size = size;
+	if (gap)
+		pidff_gap_insert(pidff, block);
+}
 
-				list_add(&new_block->list, &block->list);
+/*
+ * Insert a block into the offset tree, keeping subtree gaps up to date
+ */
+static void pidff_offset_insert(struct pidff_device *pidff,
+		struct pidff_memory_block *block)
+{
+	struct rb_node **link = &pidff->memory_by_offset.rb_node;
+	struct rb_node *parent = NULL;
+	struct pidff_memory_block *entry;
+
+	block->subtree_gap = block->gap;
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct pidff_memory_block, offset_node);
+		if (entry->subtree_gap < block->gap)
+			entry->subtree_gap = block->gap;
+
+		if (block->block_offset < entry->block_offset)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
 
-				pidff->pid_used_ram += size;
+	rb_link_node(&block->offset_node, parent, link);
+	rb_insert_augmented(&block->offset_node, &pidff->memory_by_offset,
+		&pidff_gap_callbacks);
+}
 
-#ifdef DEBUG_MEM_ALLOC
-				hid_dbg(pidff->hid, "Block allocated at 0x%x size %d, ram used%d\n",
-					new_block->block_offset,
-					new_block->size,
-					pidff->pid_used_ram);
-#endif
-				return new_block;
-			}
+/*
+ * Find the lowest addressed block followed by at least size bytes of free
+ * memory. Subtrees without a large enough gap are skipped, so this is
+ * O(log n) in the number of allocated blocks.
+ */
+static struct pidff_memory_block *pidff_find_first_fit(
+		struct pidff_device *pidff, unsigned int size)
+{
+	struct rb_node *node = pidff->memory_by_offset.rb_node;
+	struct pidff_memory_block *block;
 
-		/* Last block and large enough area at the end */
-		} else if(size <= (pidff->pid_total_ram -
-						block->block_offset - block->size)) {
-			new_block = kzalloc(sizeof(*new_block),	GFP_KERNEL);
-			if (!new_block)
-				return NULL;
+	if (!node || rb_entry(node, struct pidff_memory_block,
+			offset_node)->subtree_gap < size)
+		return NULL;
 
-			offset = block->block_offset + block->size;
-			new_block->block_index = pidff->active.id;
-			new_block->block_offset = offset;
-			new_block->size = size;
+	while (node) {
+		block = rb_entry(node, struct pidff_memory_block, offset_node);
 
-			list_add(&new_block->list, &block->list);
+		if (node->rb_left && rb_entry(node->rb_left,
+				struct pidff_memory_block,
+				offset_node)->subtree_gap >= size) {
+			node = node->rb_left;
+			continue;
+		}
 
-			pidff->pid_used_ram += size;
+		if (block->gap >= size)
+			return block;
 
-#ifdef DEBUG_MEM_ALLOC
-			hid_dbg(pidff->hid, "Block allocated at 0x%x size %d, ram used %d\n",
-				new_block->block_offset, size,
-				pidff->pid_used_ram);
-#endif
-			return new_block;
+		node = node->rb_right;
+	}
+	return NULL;
+}
 
+/*
+ * Find the block followed by the smallest gap that still fits size bytes
+ */
+static struct pidff_memory_block *pidff_find_best_fit(
+		struct pidff_device *pidff, unsigned int size)
+{
+	struct rb_node *node = pidff->memory_by_gap.rb_node;
+	struct pidff_memory_block *block, *best = NULL;
+
+	while (node) {
+		block = rb_entry(node, struct pidff_memory_block, gap_node);
+		if (block->gap >= size) {
+			best = block;
+			node = node->rb_left;
 		} else {
-			/* TODO: Enough free memory but not in consecutive
-			 * area so need to move old blocks around (defragment)
-			 * to fit the new effect. For now, just fail.
-			 */
-			return NULL;
+			node = node->rb_right;
 		}
 	}
-	return NULL;
+	return best;
 }
 
 /*
- * Free whole memory, i.e. delete the linked list
+ * Offset of the first parameter block in the device memory pool
  */
-static void pidff_empty_memory(struct pidff_device *pidff)
+static unsigned int pidff_pool_start(struct pidff_device *pidff)
 {
-	struct pidff_memory_block *block, *temp;
-
-	list_for_each_entry_safe(block, temp, &pidff->memory, list) {
-		list_del(&block->list);
-		kfree(block);
+	unsigned int offset;
+
+	offset = pidff_report_store_size(pidff, PID_SET_EFFECT);
+	if (offset == 0) {
+		/* If SET_EFFECT report size is not defined, assume they
+		 * are not stored in pool and blocks can be stored at the
+		 * beginning of pool. However address 0 does not seem to
+		 * work so starting at first aligned offset.
+		 */
+		if (pidff->block_offset[0].field)
+			offset = pidff->block_offset[0].field->logical_minimum;
+		else
+			offset = pidff->alignment;	/* This is a hack... */
+	} else {
+		/* If SET_EFFECT size was defined, assume they are stored
+		 * at the beginning of pool so the blocks must start after
+		 * the maximum amount of effects.
+		 */
+		offset = pidff_align(pidff, offset) * pidff->max_effects;
 	}
 
-	pidff->pid_used_ram = 0;
+	return pidff_align(pidff, offset);
 }
 
 /*
- * Free an allocated memory block
+ * (Re)initialize the empty memory pool. Until the pool size and alignment
+ * have been read from the device the pool has no free memory at all.
  */
-static void pidff_free_memory_block(struct pidff_device *pidff,
-		struct pidff_memory_block *block)
+static void pidff_init_memory(struct pidff_device *pidff)
 {
-	list_del(&block->list);
-	pidff->pid_used_ram -= block->size;
-#ifdef DEBUG_MEM_ALLOC
-	hid_dbg(pidff->hid, "Block freed from 0x%x, ram used %d\n",
-		block->block_offset, pidff->pid_used_ram);
-#endif
-	kfree(block);
+	struct pidff_memory_block *head = &pidff->pool_head;
+	unsigned int start = 0;
+	int i;
+
+	INIT_LIST_HEAD(&pidff->memory);
+	pidff->memory_by_offset = RB_ROOT;
+	pidff->memory_by_gap = RB_ROOT;
+	pidff->blocks_used = 0;
+	pidff->nr_free_blocks = 0;
+	hash_init(pidff->shared_blocks);
+
+	for (i = 0; i < PID_SLAB_CLASSES; i++) {
+		INIT_LIST_HEAD(&pidff->slab[i].regions);
+		pidff->slab[i].nr_regions = 0;
+		pidff->slab[i].slots_used = 0;
+		pidff->slab[i].spilled = 0;
+	}
+
+	if (pidff->alignment > 0 && pidff->pid_total_ram > 0)
+		start = pidff_pool_start(pidff);
+	if (start > pidff->pid_total_ram)
+		start = pidff->pid_total_ram;
+
+	memset(head, 0, sizeof(*head));
+	head->block_index = PID_BLOCK_INDEX_NONE;
+	head->slab = PID_SLAB_NONE;
+	head->block_offset = start;
+	RB_CLEAR_NODE(&head->gap_node);
+	list_add(&head->list, &pidff->memory);
+	pidff_offset_insert(pidff, head);
+	pidff_set_gap(pidff, head, pidff->pid_total_ram - start);
+
+	pidff->pid_used_ram = start;
 }
 
 /*
- * Get existing block or allocate a new block for effect info.
- * n is which block offset/axis is used.
- * 1 is magnitude, period, ramp or X axis
- * 2 is envelope or Y axis
- * Returns the offset or -1 on error.
+ * Keep a shadow of the values of report for nr_keys blocks
  */
-static int pidff_get_or_allocate_block(struct pidff_device *pidff,
-		int effect_id, int size, int n)
+static int pidff_shadow_alloc(struct pidff_device *pidff, int report,
+		unsigned int nr_keys)
 {
-	int i, offset;
-	struct pidff_memory_block *block;
-
-	/* Offsets start from 1..., scale to 0... */
-	n--;
-	if (n < 0 || n >= PID_AXES_MAX)
-		return -1;
+	struct pidff_shadow *shadow = &pidff->shadow[report];
+	struct hid_report *hid_report = pidff->reports[report];
+	int i;
 
-	/* Make sure the size alignment is correct */
-	size += size % pidff->alignment;
+	if (!hid_report)
+		return 0;
 
-	for (i = 0; i < pidff->max_effects; i++) {
-		if (pidff->effect[i].id == effect_id) {
-			if (!pidff->effect[i].offset[n]) {
-				/* Memory not yet allocated */
-				block = pidff_allocate_memory_block(pidff, size);
-				if (!block)
-					return -1;
+	shadow->nr_values = 0;
+	for (i = 0; i < hid_report->maxfield; i++)
+		shadow->nr_values += hid_report->field[i]->report_count;
 
-				offset = block->block_offset;
-				block->offset_num = n;
-				pidff->effect[i].offset[n] = block;
+	shadow->values = kcalloc(nr_keys * shadow->nr_values,
+		sizeof(*shadow->values), GFP_KERNEL);
+	shadow->valid = bitmap_zalloc(nr_keys, GFP_KERNEL);
+	if (!shadow->values || !shadow->valid)
+		return -ENOMEM;
 
-#ifdef DEBUG_MEM_ALLOC
-				hid_dbg(pidff->hid, "New block allocated");
-#endif
-			} else if (pidff->effect[i].offset[n]->size == size) {
-				/* Block can be re-used */
-				offset = pidff->effect[i].offset[n]->block_offset;
-#ifdef DEBUG_MEM_ALLOC
-				hid_dbg(pidff->hid, "Block re-used");
-#endif
-			} else {
-				/* Block was wrong size */
-#ifdef DEBUG_MEM_ALLOC
-				hid_dbg(pidff->hid, "Wrong size %d!=%d block re-allocated", pidff->effect[i].offset[n]->size, size);
-#endif
-				pidff_free_memory_block(pidff, pidff->effect[i].offset[n]);
-				block = pidff_allocate_memory_block(pidff, size);
-				if (!block)
-					return -1;
-
-				offset = block->block_offset;
-				block->offset_num = n;
-				pidff->effect[i].offset[n] = block;
-			}
-#ifdef DEBUG_MEM_ALLOC
-			hid_dbg(pidff->hid, "Block for %d (%d) at 0x%x\n",
-				effect_id, n+1, offset);
-#endif
-			return offset;
-		}
-	}
-	return -1;
+	shadow->nr_keys = nr_keys;
+	return 0;
 }
 
 /*
- * Scale an unsigned value with range 0..max for the given field
+ * Free all report shadows
  */
-static int pidff_rescale(int i, int max, struct hid_field *field)
+static void pidff_shadow_free(struct pidff_device *pidff)
 {
-	return i * (field->logical_maximum - field->logical_minimum) / max +
-	    field->logical_minimum;
+	int i;
+
+	for (i = 0; i < sizeof(pidff_reports); i++) {
+		kfree(pidff->shadow[i].values);
+		bitmap_free(pidff->shadow[i].valid);
+		pidff->shadow[i].values = NULL;
+		pidff->shadow[i].valid = NULL;
+		pidff->shadow[i].nr_keys = 0;
+	}
 }
 
 /*
- * Scale a signed value in range -0x8000..0x7fff for the given field
+ * Forget what the device holds for block key of report
  */
-static int pidff_rescale_signed(int i, struct hid_field *field)
+static void pidff_shadow_forget(struct pidff_device *pidff, int report,
+		int key)
 {
-	return i == 0 ? 0 : i >
-	    0 ? i * field->logical_maximum / 0x7fff : i *
-	    field->logical_minimum / -0x8000;
+	struct pidff_shadow *shadow = &pidff->shadow[report];
+
+	if (key >= 0 && key < shadow->nr_keys)
+		clear_bit(key, shadow->valid);
 }
 
-static void pidff_set(struct pidff_usage *usage, u16 value)
+/*
+ * Forget what the device holds for an arena block, e.g. after the block
+ * was reused or moved
+ */
+static void pidff_shadow_forget_block(struct pidff_device *pidff,
+		struct pidff_memory_block *block)
 {
-	if (!usage)
-		return;
-	usage->value[0] = pidff_rescale(value, 0xffff, usage->field);
-#ifdef DEBUG_SCALING
-	pr_debug("calculated from %d to %d\n", value, usage->value[0]);
-#endif
+	int i;
+
+	for (i = PID_SET_ENVELOPE; i <= PID_SET_RAMP; i++)
+		pidff_shadow_forget(pidff, i, block - pidff->blocks);
 }
 
-static void pidff_set_signed(struct pidff_usage *usage, s16 value)
+/*
+ * Forget everything the device holds, e.g. after a reset
+ */
+static void pidff_shadow_reset(struct pidff_device *pidff)
 {
-	if (usage->field->logical_minimum < 0)
-		usage->value[0] = pidff_rescale_signed(value, usage->field);
-	else {
-		if (value < 0)
-			usage->value[0] =
-			    pidff_rescale(-value, 0x8000, usage->field);
-		else
-			usage->value[0] =
-			    pidff_rescale(value, 0x7fff, usage->field);
-	}
-#ifdef DEBUG_SCALING
-	pr_debug("calculated from %d to %d\n", value, usage->value[0]);
-#endif
+	int i;
+
+	for (i = 0; i < sizeof(pidff_reports); i++)
+		if (pidff->shadow[i].valid)
+			bitmap_zero(pidff->shadow[i].valid,
+				pidff->shadow[i].nr_keys);
 }
 
 /*
- * Send envelope report to the device
+ * Keep the stream timer away from the reports, blocks and offsets while
+ * process context works on them
  */
-static int pidff_set_envelope_report(struct pidff_device *pidff,
-				      struct ff_envelope *envelope)
+static void pidff_hold_reports(struct pidff_device *pidff)
 {
-	int offset;
-
-	if (IS_DEVICE_MANAGED(pidff)) {
-		pidff->set_envelope[PID_EFFECT_BLOCK_INDEX].value[0] =
-		    pidff->active.id;
-	} else {
-		offset = pidff_get_or_allocate_block(pidff, pidff->active.id,
-			pidff_report_store_size(pidff,
-			PID_SET_ENVELOPE), 2);
-		if (offset < 0)
-			return -ENOSPC;
+	unsigned long flags;
 
-		pidff->set_envelope[PID_PARAM_BLOCK_OFFSET].value[0] = offset;
-	}
+	spin_lock_irqsave(&pidff->lock, flags);
+	pidff->report_hold++;
+	spin_unlock_irqrestore(&pidff->lock, flags);
+}
 
-	pidff->set_envelope[PID_ATTACK_LEVEL].value[0] =
-	    pidff_rescale(envelope->attack_level >
-		0x7fff ? 0x7fff : envelope->attack_level, 0x7fff,
-		pidff->set_envelope[PID_ATTACK_LEVEL].field);
-	pidff->set_envelope[PID_FADE_LEVEL].value[0] =
-	    pidff_rescale(envelope->fade_level >
-		0x7fff ? 0x7fff : envelope->fade_level, 0x7fff,
-		pidff->set_envelope[PID_FADE_LEVEL].field);
+static void pidff_release_reports(struct pidff_device *pidff)
+{
+	unsigned long flags;
 
-	pidff->set_envelope[PID_ATTACK_TIME].value[0] = envelope->attack_length;
-	pidff->set_envelope[PID_FADE_TIME].value[0] = envelope->fade_length;
+	spin_lock_irqsave(&pidff->lock, flags);
+	pidff->report_hold--;
+	spin_unlock_irqrestore(&pidff->lock, flags);
+}
 
-#ifdef DEBUG_SCALING
-	hid_dbg(pidff->hid, "attack %u => %d\n",
-		envelope->attack_level,
-		pidff->set_envelope[PID_ATTACK_LEVEL].value[0]);
-#endif
+/*
+ * Queue deferred work unless the device is gone. Call with the ff mutex,
+ * the device lock or the scheduler lock held, any of which keeps the
+ * device from being marked dead meanwhile.
+ */
+static void pidff_queue_work(struct pidff_device *pidff,
+			     struct work_struct *work)
+{
+	if (!pidff->dead)
+		queue_work(pidff->wq, work);
+}
 
-	hid_hw_request(pidff->hid, pidff->reports[PID_SET_ENVELOPE],
-		HID_REQ_SET_REPORT);
-	return 0;
+static void pidff_queue_delayed(struct pidff_device *pidff,
+				struct delayed_work *work, unsigned long delay)
+{
+	if (!pidff->dead)
+		queue_delayed_work(pidff->wq, work, delay);
 }
 
 /*
- * Test if the new envelope differs from old one
+ * Number of output reports waiting in usbhid. usbhid moves its queue
+ * indices under its own lock, which nests inside ours as it does when a
+ * report is submitted.
  */
-static int pidff_needs_set_envelope(struct ff_envelope *envelope,
-				    struct ff_envelope *old)
+static unsigned int pidff_output_depth(struct pidff_device *pidff)
 {
-	return envelope->attack_level != old->attack_level ||
-	       envelope->fade_level != old->fade_level ||
-	       envelope->attack_length != old->attack_length ||
-	       envelope->fade_length != old->fade_length;
+	struct usbhid_device *usbhid = pidff->hid->driver_data;
+	unsigned long flags;
+	unsigned int depth;
+
+	spin_lock_irqsave(&usbhid->lock, flags);
+	if (usbhid->urbout)
+		depth = (usbhid->outhead - usbhid->outtail) &
+			(HID_OUTPUT_FIFO_SIZE - 1);
+	else
+		depth = (usbhid->ctrlhead - usbhid->ctrltail) &
+			(HID_CONTROL_FIFO_SIZE - 1);
+	spin_unlock_irqrestore(&usbhid->lock, flags);
+
+	return depth;
 }
 
 /*
- * Send constant force report to the device
+ * Test if a report is sent ahead of waiting parameter reports
  */
-static int pidff_set_constant_force_report(struct pidff_device *pidff,
-					    struct ff_effect *effect)
+static int pidff_control_report(int report)
 {
-	int offset;
+	return report == PID_EFFECT_OPERATION || report == PID_DEVICE_GAIN ||
+		report == PID_DEVICE_CONTROL;
+}
 
-	if (IS_DEVICE_MANAGED(pidff)) {
-		pidff->set_constant[PID_EFFECT_BLOCK_INDEX].value[0] =
-			pidff->active.id;
-	} else {
-		offset = pidff_get_or_allocate_block(pidff, pidff->active.id,
-			pidff_report_store_size(pidff,
-			PID_SET_CONSTANT), 1);
-		if (offset < 0)
-			return -ENOSPC;
+/*
+ * Send the oldest waiting report. Its values are swapped into the report
+ * fields for the send, so the caller must own them: process context under
+ * the ff mutex with the reports held, and the device lock for the effect
+ * operation.
+ */
+static void pidff_sched_send(struct pidff_device *pidff)
+{
+	struct pidff_sched_entry *entry = &pidff->sched[pidff->sched_tail];
+	struct hid_report *report = pidff->reports[entry->report];
+	s32 *values = pidff->sched_values +
+		pidff->sched_tail * pidff->sched_nr_values;
+	s32 *saved = pidff->sched_values +
+		PID_SCHED_SIZE * pidff->sched_nr_values;
+	s64 wait;
+	int i, n;
+
+	for (i = 0, n = 0; i < report->maxfield; i++) {
+		memcpy(saved + n, report->field[i]->value,
+			report->field[i]->report_count * sizeof(s32));
+		memcpy(report->field[i]->value, values + n,
+			report->field[i]->report_count * sizeof(s32));
+		n += report->field[i]->report_count;
+	}
+	hid_hw_request(pidff->hid, report, HID_REQ_SET_REPORT);
 
-		pidff->set_constant[PID_PARAM_BLOCK_OFFSET].value[0] = offset;
+	/* The report has been put together, bring back what was built since */
+	for (i = 0, n = 0; i < report->maxfield; i++) {
+		memcpy(report->field[i]->value, saved + n,
+			report->field[i]->report_count * sizeof(s32));
+		n += report->field[i]->report_count;
 	}
 
-	pidff_set_signed(&pidff->set_constant[PID_MAGNITUDE],
-		effect->u.constant.level);
+	wait = ktime_us_delta(ktime_get(), entry->queued);
+	pidff->bulk_wait_sum += wait;
+	if (wait > pidff->bulk_wait_max)
+		pidff->bulk_wait_max = wait;
 
-	hid_hw_request(pidff->hid, pidff->reports[PID_SET_CONSTANT],
-		HID_REQ_SET_REPORT);
-	return 0;
+	if (entry->pid >= 0)
+		pidff->sched_pid[entry->pid]--;
+	pidff->sched_tail = (pidff->sched_tail + 1) % PID_SCHED_SIZE;
 }
 
 /*
- * Test if the constant parameters have changed between effects
+ * Send waiting reports while usbhid has room for them, or all of them
  */
-static int pidff_needs_set_constant(struct ff_effect *effect,
-				    struct ff_effect *old)
+static void pidff_sched_run(struct pidff_device *pidff, int all)
 {
-	return effect->u.constant.level != old->u.constant.level;
+	unsigned long flags;
+	int more;
+
+	if (!pidff->sched)
+		return;
+
+	pidff_hold_reports(pidff);
+	do {
+		spin_lock_irqsave(&pidff->lock, flags);
+		spin_lock(&pidff->sched_lock);
+		more = !pidff->dead && pidff->sched_head != pidff->sched_tail &&
+			(all || pidff_output_depth(pidff) < PID_SCHED_DEPTH);
+		if (more)
+			pidff_sched_send(pidff);
+		spin_unlock(&pidff->sched_lock);
+		spin_unlock_irqrestore(&pidff->lock, flags);
+	} while (more);
+	pidff_release_reports(pidff);
+}
+
+static void pidff_sched_work(struct work_struct *work)
+{
+	struct pidff_device *pidff = container_of(to_delayed_work(work),
+		struct pidff_device, sched_work);
+	struct ff_device *ff = pidff->input->ff;
+
+	mutex_lock(&ff->mutex);
+	pidff_sched_run(pidff, 0);
+	if (pidff->sched_head != pidff->sched_tail)
+		pidff_queue_delayed(pidff, &pidff->sched_work, 1);
+	mutex_unlock(&ff->mutex);
 }
 
 /*
- * Send set effect report to the device
+ * Send an output report. Parameter reports wait in the driver while usbhid
+ * already has enough queued, so that control reports can get ahead of
+ * them. Reports of the same effect are kept in order, pid is -1 for
+ * reports that do not need that.
  */
-static void pidff_set_effect_report(struct pidff_device *pidff,
-				    struct ff_effect *effect)
+static void pidff_submit(struct pidff_device *pidff, int report, int pid)
 {
-	int i;
+	struct hid_report *hid_report = pidff->reports[report];
+	unsigned int depth, next;
+	unsigned long flags;
+	s32 *values;
+	int i, direct;
 
-	pidff->set_effect[PID_EFFECT_BLOCK_INDEX].value[0] =
+	if (pid > PID_EFFECTS_MAX)
+		pid = -1;
+
+	spin_lock_irqsave(&pidff->sched_lock, flags);
+
+	/* The device is gone, and usbhid with it */
+	if (pidff->dead)
+		goto out;
+
+	if (!pidff->sched) {
+		hid_hw_request(pidff->hid, hid_report, HID_REQ_SET_REPORT);
+		goto out;
+	}
+
+	depth = pidff_output_depth(pidff);
+	if (pidff_control_report(report))
+		direct = pid < 0 || !pidff->sched_pid[pid];
+	else
+		direct = pidff->sched_head == pidff->sched_tail &&
+			depth < PID_SCHED_DEPTH;
+
+	next = (pidff->sched_head + 1) % PID_SCHED_SIZE;
+	if (!direct && next == pidff->sched_tail) {
+		/* Should not happen, rather send out of order than drop */
+		pidff->bulk_overflows++;
+		direct = 1;
+	}
+
+	if (direct) {
+		hid_hw_request(pidff->hid, hid_report, HID_REQ_SET_REPORT);
+		if (pidff_control_report(report)) {
+			pidff->control_sent++;
+			pidff->control_depth_sum += depth;
+			if (depth > pidff->control_depth_max)
+				pidff->control_depth_max = depth;
+		}
+		goto out;
+	}
+
+	values = pidff->sched_values +
+		pidff->sched_head * pidff->sched_nr_values;
+	for (i = 0; i < hid_report->maxfield; i++) {
+		memcpy(values, hid_report->field[i]->value,
+			hid_report->field[i]->report_count * sizeof(s32));
+		values += hid_report->field[i]->report_count;
+	}
+	pidff->sched[pidff->sched_head].report = report;
+	pidff->sched[pidff->sched_head].pid = pid;
+	pidff->sched[pidff->sched_head].queued = ktime_get();
+	pidff->sched_head = next;
+	if (pid >= 0)
+		pidff->sched_pid[pid]++;
+
+	pidff->bulk_queued++;
+	depth = (pidff->sched_head - pidff->sched_tail) % PID_SCHED_SIZE;
+	if (depth > pidff->bulk_depth_max)
+		pidff->bulk_depth_max = depth;
+
+	pidff_queue_delayed(pidff, &pidff->sched_work, 0);
+out:
+	spin_unlock_irqrestore(&pidff->sched_lock, flags);
+}
+
+/*
+ * Wait until the device has received all reports
+ */
+static void pidff_wait(struct pidff_device *pidff)
+{
+	pidff_sched_run(pidff, 1);
+	if (!pidff->dead)
+		hid_hw_wait(pidff->hid);
+}
+
+/*
+ * Send an output report of effect pid unless the device already holds the
+ * same values for block key. Reports without a shadow or key are always
+ * sent.
+ *
+ * Returns 1 if the report was sent, 0 if it was elided.
+ */
+static int pidff_send_report(struct pidff_device *pidff, int report, int key,
+		int pid)
+{
+	struct pidff_shadow *shadow = &pidff->shadow[report];
+	struct hid_report *hid_report = pidff->reports[report];
+	struct hid_field *field;
+	s32 *values;
+	int i, changed;
+
+	if (!shadow->values || key < 0 || key >= shadow->nr_keys) {
+		pidff_submit(pidff, report, pid);
+		return 1;
+	}
+
+	values = shadow->values + key * shadow->nr_values;
+	changed = !test_bit(key, shadow->valid);
+	for (i = 0; i < hid_report->maxfield; i++) {
+		field = hid_report->field[i];
+		if (memcmp(values, field->value,
+			field->report_count * sizeof(s32))) {
+			memcpy(values, field->value,
+				field->report_count * sizeof(s32));
+			changed = 1;
+		}
+		values += field->report_count;
+	}
+
+	if (!changed) {
+		shadow->elided++;
+		return 0;
+	}
+
+	set_bit(key, shadow->valid);
+	pidff_submit(pidff, report, pid);
+	return 1;
+}
+
+/*
+ * Return the effect slot which uses PID effect block index pid_id, or -1
+ */
+static int pidff_find_effect(struct pidff_device *pidff, int pid_id)
+{
+	if (pid_id < 0 || pid_id > PID_EFFECTS_MAX)
+		return -1;
+
+	return pidff->pid_slot[pid_id];
+}
+
+/*
+ * Bind PID effect block index pid_id to an effect slot
+ */
+static void pidff_map_effect(struct pidff_device *pidff, int pid_id,
+		int slot, int efnum)
+{
+	if (pid_id < 0 || pid_id > PID_EFFECTS_MAX || slot < 0)
+		return;
+
+	pidff->pid_slot[pid_id] = slot;
+	pidff->effect[slot].id = pid_id;
+	pidff->effect[slot].effect_type_id = efnum;
+	pidff->effect[slot].offset[0] = NULL;
+	pidff->effect[slot].offset[1] = NULL;
+}
+
+/*
+ * Release the effect slot bound to PID effect block index pid_id
+ */
+static void pidff_unmap_effect(struct pidff_device *pidff, int pid_id)
+{
+	int slot = pidff_find_effect(pidff, pid_id);
+	unsigned long flags;
+
+	if (slot < 0)
+		return;
+
+	spin_lock_irqsave(&pidff->lock, flags);
+	pidff->pid_slot[pid_id] = -1;
+	pidff->effect[slot].id = -1;
+	pidff->effect[slot].offset[0] = NULL;
+	pidff->effect[slot].offset[1] = NULL;
+	pidff->effect[slot].playing = 0;
+	pidff->effect[slot].resident = 0;
+	spin_unlock_irqrestore(&pidff->lock, flags);
+}
+
+/*
+ * Test if an effect may currently be using its parameter blocks on the
+ * device, in which case they must not be rewritten
+ */
+static int pidff_effect_busy(struct pidff_device *pidff, int slot)
+{
+	struct pidff_info *info = &pidff->effect[slot];
+
+	/* The device starts triggered effects on its own */
+	if (info->effect.trigger.button)
+		return 1;
+
+	if (!info->playing)
+		return 0;
+
+	if (!info->effect.replay.length)
+		return 1;
+
+	return time_before(jiffies, info->play_until);
+}
+
+/*
+ * Test if the device got a stop after the last start of an effect, so that
+ * another stop has nothing to do. Play times are host side guesses, a
+ * start may have waited in the queues, so they are not trusted here.
+ */
+static int pidff_effect_stopped(struct pidff_device *pidff, int slot)
+{
+	struct pidff_info *info = &pidff->effect[slot];
+
+	return !info->playing && !info->effect.trigger.button;
+}
+
+/*
+ * Resend the set effect report of an already uploaded effect, e.g. after its
+ * parameter blocks have been moved in device memory. If the blocks were
+ * moved without their contents the parameter reports are sent too.
+ */
+static void pidff_resend_effect(struct pidff_device *pidff, int slot)
+{
+	struct pidff_info saved = pidff->active;
+	int saved_slot = pidff->image_slot;
+
+	pidff->active = pidff->effect[slot];
+	if (!pidff_restore_effect(pidff, slot, pidff->effect[slot].reload)) {
+		pidff->image_slot = slot;
+		if (pidff->effect[slot].reload &&
+			pidff_set_parameter_reports(pidff,
+				&pidff->effect[slot].effect))
+			hid_warn(pidff->hid, "failed to reload effect %d\n",
+				slot);
+		pidff_set_effect_report(pidff, &pidff->effect[slot].effect);
+	}
+	pidff->active = saved;
+	pidff->image_slot = saved_slot;
+
+	pidff->effect[slot].relocated = 0;
+	pidff->effect[slot].reload = 0;
+}
+
+/*
+ * Ask the device to move len bytes of its memory pool from src to dst
+ */
+static void pidff_move_block(struct pidff_device *pidff, unsigned int src,
+		unsigned int dst, unsigned int len)
+{
+	pidff->pool_move[PID_MOVE_SOURCE].value[0] = src;
+	pidff->pool_move[PID_MOVE_DESTINATION].value[0] = dst;
+	pidff->pool_move[PID_MOVE_LENGTH].value[0] = len;
+
+#ifdef DEBUG_MEM_ALLOC
+	hid_dbg(pidff->hid, "Pool move %d bytes from 0x%x to 0x%x\n",
+		len, src, dst);
+#endif
+	pidff_submit(pidff, PID_POOL_MOVE, -1);
+}
+
+/*
+ * Test if a block may be used by more than one effect
+ */
+static int pidff_block_shared(struct pidff_memory_block *block)
+{
+	return block->type == PID_BLOCK_REGION ||
+		hash_hashed(&block->hash_node);
+}
+
+/*
+ * Test if an effect stores any of its parameter blocks in block
+ */
+static int pidff_effect_uses(struct pidff_info *info,
+		struct pidff_memory_block *block)
+{
+	int n;
+
+	for (n = 0; n < PID_AXES_MAX; n++)
+		if (info->offset[n] && (info->offset[n] == block ||
+			info->offset[n]->region == block))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Test if a block has to stay in place while defragmenting. Without pool
+ * move the contents of moved blocks are uploaded again, which is only done
+ * for idle effects that are not in the middle of an upload.
+ */
+static int pidff_block_pinned(struct pidff_device *pidff,
+		struct pidff_memory_block *block, int relayout)
+{
+	int pid_id, slot;
+
+	if (block == &pidff->pool_head)
+		return 1;
+	if (!relayout)
+		return 0;
+
+	if (!pidff_block_shared(block)) {
+		slot = pidff_find_effect(pidff, block->block_index);
+		return slot < 0 || pidff->effect[slot].id ==
+			pidff->active.id || pidff_effect_busy(pidff, slot);
+	}
+
+	for (pid_id = 0; pid_id <= PID_EFFECTS_MAX; pid_id++) {
+		slot = pidff->pid_slot[pid_id];
+		if (slot < 0 || !pidff_effect_uses(&pidff->effect[slot], block))
+			continue;
+
+		if (pid_id == pidff->active.id ||
+			pidff_effect_busy(pidff, slot))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Set a new offset for a block and mark the effects using it as moved.
+ * Slots of a region move along with it.
+ */
+static void pidff_relocate_block(struct pidff_device *pidff,
+		struct pidff_memory_block *block, unsigned int offset,
+		int relayout)
+{
+	struct pidff_memory_block *part;
+	int pid_id, slot, n;
+
+	block->block_offset = offset;
+
+	for (pid_id = 0; pid_id <= PID_EFFECTS_MAX; pid_id++) {
+		slot = pidff->pid_slot[pid_id];
+		if (slot < 0)
+			continue;
+
+		if (!pidff_block_shared(block) &&
+			pid_id != block->block_index)
+			continue;
+
+		for (n = 0; n < PID_AXES_MAX; n++) {
+			part = pidff->effect[slot].offset[n];
+			if (!part || (part != block && part->region != block))
+				continue;
+
+			if (part != block)
+				part->block_offset = offset +
+					part->slab_slot * part->size;
+			pidff_shadow_forget_block(pidff, part);
+			pidff->effect[slot].relocated = 1;
+			pidff->effect[slot].reload |= relayout;
+		}
+	}
+}
+
+/*
+ * Defragment the memory pool so that a free area of at least size bytes
+ * becomes available, and return the block followed by that area.
+ *
+ * The free area is formed by sliding a run of consecutive blocks down onto
+ * the block preceding them, which merges all gaps inside the run into the
+ * gap after its last block. Of all runs that free enough memory the one
+ * with the fewest blocks is chosen, which is found with a single pass over
+ * the pool.
+ *
+ * Devices with PID_POOL_MOVE move the block contents themselves. Otherwise
+ * the pool is re-laid out by the driver: only blocks of idle effects are
+ * moved, and their reports are sent again in one batch afterwards.
+ */
+static struct pidff_memory_block *pidff_compact_memory(
+		struct pidff_device *pidff, unsigned int size)
+{
+	struct pidff_memory_block *first, *last, *block;
+	struct pidff_memory_block *best_first = NULL, *best_last = NULL;
+	unsigned int free_mem = 0, offset;
+	int count = 0, best_count = INT_MAX;
+	int relayout = !test_bit(PID_SUPPORTS_POOL_MOVE, &pidff->flags);
+	int slot;
+
+	/* Run is [first .. last], first stays in place */
+	first = &pidff->pool_head;
+	list_for_each_entry(last, &pidff->memory, list) {
+		if (pidff_block_pinned(pidff, last, relayout)) {
+			first = last;
+			free_mem = 0;
+			count = 0;
+		}
+
+		free_mem += last->gap;
+		count += last != first;
+
+		while (first != last && free_mem - first->gap >= size) {
+			free_mem -= first->gap;
+			first = list_next_entry(first, list);
+			count--;
+		}
+
+		if (free_mem >= size && count < best_count) {
+			best_first = first;
+			best_last = last;
+			best_count = count;
+		}
+	}
+
+	if (!best_first)
+		return NULL;
+
+#ifdef DEBUG_MEM_ALLOC
+	hid_dbg(pidff->hid, "Defragmenting, %s %d blocks for %d bytes\n",
+		relayout ? "reloading" : "moving", best_count, size);
+#endif
+
+	free_mem = 0;
+	offset = best_first->block_offset + best_first->size;
+	block = best_first;
+	while (block != best_last) {
+		free_mem += block->gap;
+		pidff_set_gap(pidff, block, 0);
+		block = list_next_entry(block, list);
+
+		if (block->block_offset != offset) {
+			if (!relayout)
+				pidff_move_block(pidff, block->block_offset,
+					offset, block->size);
+			/* Moving down keeps the offset ordering intact */
+			pidff_relocate_block(pidff, block, offset, relayout);
+		}
+		offset += block->size;
+	}
+	pidff_set_gap(pidff, best_last, free_mem + best_last->gap);
+
+	/* Point the moved effects to their new blocks. The effect being
+	 * uploaded sends its set effect report once the upload is done.
+	 */
+	for (slot = 0; slot < pidff->nr_effects; slot++) {
+		if (!pidff->effect[slot].relocated ||
+			pidff->effect[slot].id == pidff->active.id)
+			continue;
+
+		pidff_resend_effect(pidff, slot);
+	}
+
+	return best_last;
+}
+
+/*
+ * Allocate the block arena, one block per effect and axis plus one for the
+ * slab region each of them may need
+ */
+static int pidff_alloc_blocks(struct pidff_device *pidff)
+{
+	pidff->nr_blocks = pidff->max_effects * PID_AXES_MAX * 2;
+
+	pidff->blocks = kcalloc(pidff->nr_blocks, sizeof(*pidff->blocks),
+		GFP_KERNEL);
+	pidff->free_blocks = kcalloc(pidff->nr_blocks,
+		sizeof(*pidff->free_blocks), GFP_KERNEL);
+	if (!pidff->blocks || !pidff->free_blocks) {
+		kfree(pidff->blocks);
+		kfree(pidff->free_blocks);
+		pidff->blocks = NULL;
+		pidff->free_blocks = NULL;
+		pidff->nr_blocks = 0;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Take an unused block from the arena. NULL if all blocks are in use.
+ */
+static struct pidff_memory_block *pidff_get_block(struct pidff_device *pidff)
+{
+	struct pidff_memory_block *block;
+
+	if (pidff->nr_free_blocks)
+		block = &pidff->blocks[
+			pidff->free_blocks[--pidff->nr_free_blocks]];
+	else if (pidff->blocks_used < pidff->nr_blocks)
+		block = &pidff->blocks[pidff->blocks_used++];
+	else
+		return NULL;
+
+	/* Whatever was sent for the previous user is gone */
+	pidff_shadow_forget_block(pidff, block);
+	return block;
+}
+
+/*
+ * Return a block to the arena
+ */
+static void pidff_put_block(struct pidff_device *pidff,
+		struct pidff_memory_block *block)
+{
+	pidff->free_blocks[pidff->nr_free_blocks++] = block - pidff->blocks;
+}
+
+/*
+ * Return a new free block of the general pool. NULL on error.
+ */
+static struct pidff_memory_block *pidff_allocate_pool_block(
+		struct pidff_device *pidff, int size)
+{
+	struct pidff_memory_block *prev, *new_block;
+
+	if (pidff->pid_total_ram < (pidff->pid_used_ram + size))
+		return NULL;
+
+	if (pidff_pool_policy == PID_POOL_BEST_FIT)
+		prev = pidff_find_best_fit(pidff, size);
+	else
+		prev = pidff_find_first_fit(pidff, size);
+
+	/* Enough free memory but not in consecutive area, so move old
+	 * blocks around to fit the new effect.
+	 */
+	if (!prev)
+		prev = pidff_compact_memory(pidff, size);
+	if (!prev)
+		return NULL;
+
+	new_block = pidff_get_block(pidff);
+	if (!new_block)
+		return NULL;
+
+	new_block->offset_num = 0;
+	new_block->refcount = 1;
+	INIT_HLIST_NODE(&new_block->hash_node);
+	new_block->type = PID_BLOCK_GENERAL;
+	new_block->slab = PID_SLAB_NONE;
+	new_block->region = NULL;
+	new_block->block_index = pidff->active.id;
+	new_block->block_offset = prev->block_offset + prev->size;
+	new_block->size = size;
+	new_block->gap = prev->gap - size;
+	RB_CLEAR_NODE(&new_block->gap_node);
+
+	pidff_set_gap(pidff, prev, 0);
+	pidff_offset_insert(pidff, new_block);
+	if (new_block->gap)
+		pidff_gap_insert(pidff, new_block);
+	list_add(&new_block->list, &prev->list);
+
+	pidff->pid_used_ram += size;
+
+#ifdef DEBUG_MEM_ALLOC
+	hid_dbg(pidff->hid, "Block allocated at 0x%x size %d, ram used %d\n",
+		new_block->block_offset, new_block->size,
+		pidff->pid_used_ram);
+#endif
+	return new_block;
+}
+
+/*
+ * Free a block of the general pool. The freed memory is merged into the gap
+ * of the preceding block.
+ */
+static void pidff_free_pool_block(struct pidff_device *pidff,
+		struct pidff_memory_block *block)
+{
+	struct pidff_memory_block *prev = list_prev_entry(block, list);
+
+	if (!RB_EMPTY_NODE(&block->gap_node))
+		rb_erase(&block->gap_node, &pidff->memory_by_gap);
+	rb_erase_augmented(&block->offset_node, &pidff->memory_by_offset,
+		&pidff_gap_callbacks);
+	list_del(&block->list);
+
+	pidff_set_gap(pidff, prev, prev->gap + block->size + block->gap);
+
+	pidff->pid_used_ram -= block->size;
+#ifdef DEBUG_MEM_ALLOC
+	hid_dbg(pidff->hid, "Block freed from 0x%x, ram used %d\n",
+		block->block_offset, pidff->pid_used_ram);
+#endif
+	pidff_put_block(pidff, block);
+}
+
+/*
+ * Return a free slot of a slab region, adding a new region to the class if
+ * all of its regions are full. NULL if no region could be added.
+ */
+static struct pidff_memory_block *pidff_allocate_slab_block(
+		struct pidff_device *pidff, int class, int size)
+{
+	struct pidff_slab *slab = &pidff->slab[class];
+	struct pidff_memory_block *region, *block;
+	int slot;
+
+	list_for_each_entry(region, &slab->regions, slab_list)
+		if (region->slab_used != (1U << PID_SLAB_SLOTS) - 1)
+			goto found;
+
+	/* Do not let a single class take over a small pool */
+	if (size * PID_SLAB_SLOTS > pidff->pid_total_ram / 4)
+		return NULL;
+
+	region = pidff_allocate_pool_block(pidff, size * PID_SLAB_SLOTS);
+	if (!region)
+		return NULL;
+
+	region->type = PID_BLOCK_REGION;
+	region->slab = class;
+	region->slab_used = 0;
+	region->block_index = PID_BLOCK_INDEX_NONE;
+	list_add(&region->slab_list, &slab->regions);
+	slab->nr_regions++;
+
+found:
+	block = pidff_get_block(pidff);
+	if (!block) {
+		if (!region->slab_used) {
+			list_del(&region->slab_list);
+			slab->nr_regions--;
+			pidff_free_pool_block(pidff, region);
+		}
+		return NULL;
+	}
+
+	slot = ffz(region->slab_used);
+	region->slab_used |= BIT(slot);
+	slab->slots_used++;
+
+	block->type = PID_BLOCK_SLOT;
+	block->slab = class;
+	block->slab_slot = slot;
+	block->region = region;
+	block->block_index = pidff->active.id;
+	block->block_offset = region->block_offset + slot * size;
+	block->size = size;
+	block->offset_num = 0;
+	block->refcount = 1;
+	INIT_HLIST_NODE(&block->hash_node);
+	block->gap = 0;
+	RB_CLEAR_NODE(&block->gap_node);
+
+#ifdef DEBUG_MEM_ALLOC
+	hid_dbg(pidff->hid, "Slot %d of %s region at 0x%x allocated\n",
+		slot, pidff_slab_names[class], region->block_offset);
+#endif
+	return block;
+}
+
+/*
+ * Return a new memory block for a parameter block report. NULL on error.
+ *
+ * Parameter blocks of the same report have the same size, so each report
+ * type gets its own slab regions where freed slots can always be reused by
+ * the next block of that type. If a class cannot grow, the block spills
+ * over to the general pool.
+ */
+static struct pidff_memory_block *pidff_allocate_memory_block(
+		struct pidff_device *pidff, int report)
+{
+	struct pidff_memory_block *block;
+	int size, class = PID_SLAB_NONE;
+
+	size = pidff_report_store_size(pidff, report);
+	if (!size)
+		return NULL;
+
+	/* Make sure alignment is as the device wants */
+	size = pidff_align(pidff, size);
+
+	if (pidff_pool_slabs && report >= PID_SET_ENVELOPE &&
+		report < PID_SET_ENVELOPE + PID_SLAB_CLASSES) {
+		class = report - PID_SET_ENVELOPE;
+
+		block = pidff_allocate_slab_block(pidff, class, size);
+		if (block)
+			return block;
+	}
+
+	block = pidff_allocate_pool_block(pidff, size);
+	if (block && class != PID_SLAB_NONE) {
+		block->slab = class;
+		pidff->slab[class].spilled++;
+	}
+
+	return block;
+}
+
+/*
+ * Free whole memory. All blocks go back to the arena at once.
+ */
+static void pidff_empty_memory(struct pidff_device *pidff)
+{
+	pidff_init_memory(pidff);
+}
+
+/*
+ * Free an allocated memory block. A region is freed along with its last
+ * slot.
+ */
+static void pidff_free_memory_block(struct pidff_device *pidff,
+		struct pidff_memory_block *block)
+{
+	struct pidff_memory_block *region = block->region;
+	struct pidff_slab *slab;
+
+	if (block->refcount > 1) {
+		block->refcount--;
+		return;
+	}
+	if (hash_hashed(&block->hash_node))
+		hash_del(&block->hash_node);
+
+	if (block->type != PID_BLOCK_SLOT) {
+		if (block->slab != PID_SLAB_NONE)
+			pidff->slab[block->slab].spilled--;
+		pidff_free_pool_block(pidff, block);
+		return;
+	}
+
+	slab = &pidff->slab[block->slab];
+	region->slab_used &= ~BIT(block->slab_slot);
+	slab->slots_used--;
+#ifdef DEBUG_MEM_ALLOC
+	hid_dbg(pidff->hid, "Slot %d of %s region at 0x%x freed\n",
+		block->slab_slot, pidff_slab_names[block->slab],
+		region->block_offset);
+#endif
+	pidff_put_block(pidff, block);
+
+	if (!region->slab_used) {
+		list_del(&region->slab_list);
+		slab->nr_regions--;
+		pidff_free_pool_block(pidff, region);
+	}
+}
+
+/*
+ * Get existing block or allocate a new block for effect info.
+ * n is which block offset/axis is used.
+ * 1 is magnitude, period, ramp or X axis
+ * 2 is envelope or Y axis
+ * report is the parameter block report stored in the block.
+ * Returns the offset or -1 on error.
+ */
+static int pidff_get_or_allocate_block(struct pidff_device *pidff,
+		int effect_id, int report, int n)
+{
+	int slot, offset, size;
+	struct pidff_memory_block *block;
+	struct pidff_info *info;
+
+	/* Offsets start from 1..., scale to 0... */
+	n--;
+	if (n < 0 || n >= PID_AXES_MAX)
+		return -1;
+
+	/* Make sure the size alignment is correct */
+	size = pidff_align(pidff, pidff_report_store_size(pidff, report));
+
+	slot = pidff_find_effect(pidff, effect_id);
+	if (slot < 0)
+		return -1;
+	info = &pidff->effect[slot];
+
+	if (!info->offset[n]) {
+		/* Memory not yet allocated */
+		block = pidff_allocate_memory_block(pidff, report);
+		if (!block)
+			return -1;
+
+		offset = block->block_offset;
+		block->offset_num = n;
+		info->offset[n] = block;
+
+#ifdef DEBUG_MEM_ALLOC
+		hid_dbg(pidff->hid, "New block allocated");
+#endif
+	} else if (info->offset[n]->size == size) {
+		/* Block can be re-used */
+		offset = info->offset[n]->block_offset;
+#ifdef DEBUG_MEM_ALLOC
+		hid_dbg(pidff->hid, "Block re-used");
+#endif
+	} else {
+		/* Block was wrong size */
+#ifdef DEBUG_MEM_ALLOC
+		hid_dbg(pidff->hid, "Wrong size %d!=%d block re-allocated", info->offset[n]->size, size);
+#endif
+		pidff_free_memory_block(pidff, info->offset[n]);
+		info->offset[n] = NULL;
+		block = pidff_allocate_memory_block(pidff, report);
+		if (!block)
+			return -1;
+
+		offset = block->block_offset;
+		block->offset_num = n;
+		info->offset[n] = block;
+	}
+#ifdef DEBUG_MEM_ALLOC
+	hid_dbg(pidff->hid, "Block for %d (%d) at 0x%x\n",
+		effect_id, n+1, offset);
+#endif
+	return offset;
+}
+
+/*
+ * Return the usages of a parameter block report and their count
+ */
+static struct pidff_usage *pidff_param_usage(struct pidff_device *pidff,
+		int report, int *count)
+{
+	switch (report) {
+	case PID_SET_ENVELOPE:
+		*count = sizeof(pidff_set_envelope);
+		return pidff->set_envelope;
+	case PID_SET_CONDITION:
+		*count = sizeof(pidff_set_condition);
+		return pidff->set_condition;
+	case PID_SET_PERIODIC:
+		*count = sizeof(pidff_set_periodic);
+		return pidff->set_periodic;
+	case PID_SET_CONSTANT:
+		*count = sizeof(pidff_set_constant);
+		return pidff->set_constant;
+	case PID_SET_RAMP:
+		*count = sizeof(pidff_set_ramp);
+		return pidff->set_ramp;
+	}
+
+	*count = 0;
+	return NULL;
+}
+
+/*
+ * Look up a shared block of report holding payload
+ */
+static struct pidff_memory_block *pidff_find_shared_block(
+		struct pidff_device *pidff, int report, const s32 *payload,
+		u32 hash)
+{
+	struct pidff_memory_block *block;
+
+	hash_for_each_possible(pidff->shared_blocks, block, hash_node, hash) {
+		if (block->hash == hash && block->report == report &&
+			!memcmp(block->payload, payload,
+				sizeof(block->payload)))
+			return block;
+	}
+	return NULL;
+}
+
+/*
+ * Select the parameter block n of the active effect for the values already
+ * filled into the report, and fill in its offset.
+ *
+ * The encoded values of a block are indexed by their hash. If another effect
+ * already stored the same values, the block is shared with it instead of
+ * being uploaded again. A shared block is never written to, an effect that
+ * changes its values gets a block of its own (copy on write).
+ *
+ * Returns 1 if the report must be sent, 0 if the block already holds these
+ * values or a negative error.
+ */
+static int pidff_param_block(struct pidff_device *pidff, int report, int n)
+{
+	struct pidff_memory_block *block, *shared;
+	struct pidff_usage *usage;
+	struct pidff_info *info;
+	s32 payload[PID_PAYLOAD_MAX] = { 0 };
+	int i, count, slot, offset;
+	u32 hash;
+
+	usage = pidff_param_usage(pidff, report, &count);
+	if (!usage)
+		return -EINVAL;
+
+	if (!pidff_pool_share) {
+		offset = pidff_get_or_allocate_block(pidff, pidff->active.id,
+			report, n);
+		if (offset < 0)
+			return -ENOSPC;
+
+		usage[PID_PARAM_BLOCK_OFFSET].value[0] = offset;
+		return 1;
+	}
+
+	slot = pidff_find_effect(pidff, pidff->active.id);
+	if (slot < 0 || n < 1 || n > PID_AXES_MAX)
+		return -EINVAL;
+	info = &pidff->effect[slot];
+	n--;
+
+	for (i = 1; i < count; i++)
+		payload[i - 1] = usage[i].value[0];
+	hash = jhash2((u32 *)payload, PID_PAYLOAD_MAX, report);
+
+	block = info->offset[n];
+	if (block && block->report == report && hash_hashed(&block->hash_node) &&
+		block->hash == hash &&
+		!memcmp(block->payload, payload, sizeof(payload))) {
+		/* Unchanged values, only resend if the contents were lost */
+		usage[PID_PARAM_BLOCK_OFFSET].value[0] = block->block_offset;
+		return info->reload;
+	}
+
+	shared = pidff_find_shared_block(pidff, report, payload, hash);
+	if (shared) {
+		if (block)
+			pidff_free_memory_block(pidff, block);
+		shared->refcount++;
+		info->offset[n] = shared;
+		pidff->shared_hits++;
+
+#ifdef DEBUG_MEM_ALLOC
+		hid_dbg(pidff->hid, "Block at 0x%x shared by %d users\n",
+			shared->block_offset, shared->refcount);
+#endif
+		usage[PID_PARAM_BLOCK_OFFSET].value[0] = shared->block_offset;
+		return 0;
+	}
+
+	if (block && block->refcount > 1) {
+		/* Copy on write */
+		pidff_free_memory_block(pidff, block);
+		info->offset[n] = NULL;
+	} else if (block && hash_hashed(&block->hash_node)) {
+		hash_del(&block->hash_node);
+	}
+
+	offset = pidff_get_or_allocate_block(pidff, pidff->active.id,
+		report, n + 1);
+	if (offset < 0)
+		return -ENOSPC;
+
+	block = info->offset[n];
+	block->report = report;
+	block->refcount = 1;
+	block->hash = hash;
+	memcpy(block->payload, payload, sizeof(payload));
+	hash_add(pidff->shared_blocks, &block->hash_node, hash);
+
+	/* Defragmenting may have reused the report for other effects */
+	for (i = 1; i < count; i++)
+		usage[i].value[0] = payload[i - 1];
+	usage[PID_PARAM_BLOCK_OFFSET].value[0] = offset;
+	return 1;
+}
+
+/*
+ * Scale an unsigned value with range 0..max for the given field
+ */
+static int pidff_rescale(int i, int max, struct hid_field *field)
+{
+	return i * (field->logical_maximum - field->logical_minimum) / max +
+	    field->logical_minimum;
+}
+
+/*
+ * Scale a signed value in range -0x8000..0x7fff for the given field
+ */
+static int pidff_rescale_signed(int i, struct hid_field *field)
+{
+	return i == 0 ? 0 : i >
+	    0 ? i * field->logical_maximum / 0x7fff : i *
+	    field->logical_minimum / -0x8000;
+}
+
+/*
+ * Fixed point factor to scale 0..max to 0..range. The result is rounded up,
+ * which gives the same results as dividing for any input up to 0xffff.
+ */
+static u64 pidff_scale_factor(s64 range, int max)
+{
+	if (range < 0 || range > S32_MAX)
+		return 0;
+
+	return div_u64((u64)range << 32, max) + 1;
+}
+
+/*
+ * Compute the rescaling factors of field
+ */
+static void pidff_init_scale(u64 *scale, struct hid_field *field)
+{
+	s64 range = (s64)field->logical_maximum - field->logical_minimum;
+
+	scale[PID_SCALE_FULL] = pidff_scale_factor(range, 0xffff);
+	scale[PID_SCALE_POSITIVE] = pidff_scale_factor(range, 0x7fff);
+	scale[PID_SCALE_NEGATIVE] = pidff_scale_factor(range, 0x8000);
+	scale[PID_SCALE_SIGNED] =
+		pidff_scale_factor(field->logical_maximum, 0x7fff);
+}
+
+/*
+ * pidff_rescale() with a precomputed factor, i must be in 0..max
+ */
+static int pidff_scale(u64 factor, int i, int max, struct hid_field *field)
+{
+	if (!factor)
+		return pidff_rescale(i, max, field);
+
+	return (int)(((u64)i * factor) >> 32) + field->logical_minimum;
+}
+
+/*
+ * pidff_rescale_signed() with a precomputed factor for positive values.
+ * Negative values are divided by 0x8000, which is a shift.
+ */
+static int pidff_scale_signed(u64 factor, int i, struct hid_field *field)
+{
+	if (!factor)
+		return pidff_rescale_signed(i, field);
+
+	if (i >= 0)
+		return (int)(((u64)i * factor) >> 32);
+
+	return -(int)(((s64)-i * -field->logical_minimum) >> 15);
+}
+
+static void pidff_set(struct pidff_usage *usage, u16 value)
+{
+	if (!usage)
+		return;
+	usage->value[0] = pidff_scale(usage->scale[PID_SCALE_FULL], value,
+		0xffff, usage->field);
+#ifdef DEBUG_SCALING
+	pr_debug("calculated from %d to %d\n", value, usage->value[0]);
+#endif
+}
+
+static void pidff_set_signed(struct pidff_usage *usage, s16 value)
+{
+	if (usage->field->logical_minimum < 0)
+		usage->value[0] = pidff_scale_signed(
+			usage->scale[PID_SCALE_SIGNED], value, usage->field);
+	else {
+		if (value < 0)
+			usage->value[0] = pidff_scale(
+				usage->scale[PID_SCALE_NEGATIVE], -value,
+				0x8000, usage->field);
+		else
+			usage->value[0] = pidff_scale(
+				usage->scale[PID_SCALE_POSITIVE], value,
+				0x7fff, usage->field);
+	}
+#ifdef DEBUG_SCALING
+	pr_debug("calculated from %d to %d\n", value, usage->value[0]);
+#endif
+}
+
+/*
+ * Shadow key of parameter block n (1..) of the active effect
+ */
+static int pidff_param_key(struct pidff_device *pidff, int n)
+{
+	struct pidff_memory_block *block;
+	int slot;
+
+	if (IS_DEVICE_MANAGED(pidff))
+		return pidff->active.id * PID_AXES_MAX + n - 1;
+
+	slot = pidff_find_effect(pidff, pidff->active.id);
+	if (slot < 0)
+		return -1;
+
+	block = pidff->effect[slot].offset[n - 1];
+	return block ? block - pidff->blocks : -1;
+}
+
+/*
+ * Field values of image index of the effect in slot
+ */
+static s32 *pidff_image(struct pidff_device *pidff, int slot, int index)
+{
+	return pidff->images + slot * pidff->image_stride +
+		pidff->image_offset[index];
+}
+
+/*
+ * Number of field values of a report
+ */
+static unsigned int pidff_nr_values(struct hid_report *report)
+{
+	unsigned int nr_values = 0;
+	int i;
+
+	for (i = 0; report && i < report->maxfield; i++)
+		nr_values += report->field[i]->report_count;
+
+	return nr_values;
+}
+
+/*
+ * Lay out the images of an effect, the set effect report first and then
+ * room for the largest parameter report in each block
+ */
+static int pidff_alloc_images(struct pidff_device *pidff)
+{
+	unsigned int param = 0;
+	int i;
+
+	for (i = PID_SET_ENVELOPE; i <= PID_SET_RAMP; i++)
+		param = max(param, pidff_nr_values(pidff->reports[i]));
+
+	pidff->image_offset[0] = 0;
+	pidff->image_stride = pidff_nr_values(pidff->reports[PID_SET_EFFECT]);
+	for (i = 1; i < PID_IMAGES; i++) {
+		pidff->image_offset[i] = pidff->image_stride;
+		pidff->image_stride += param;
+	}
+
+	pidff->images = kcalloc(pidff->nr_effects,
+		pidff->image_stride * sizeof(*pidff->images), GFP_KERNEL);
+	return pidff->images ? 0 : -ENOMEM;
+}
+
+/*
+ * Save the field values of report as image index of the effect in slot
+ */
+static void pidff_save_image(struct pidff_device *pidff, int slot, int index,
+			     int report)
+{
+	struct hid_report *hid_report = pidff->reports[report];
+	s32 *values;
+	int i;
+
+	if (!pidff->images || slot < 0)
+		return;
+
+	values = pidff_image(pidff, slot, index);
+	for (i = 0; i < hid_report->maxfield; i++) {
+		memcpy(values, hid_report->field[i]->value,
+			hid_report->field[i]->report_count * sizeof(s32));
+		values += hid_report->field[i]->report_count;
+	}
+
+	pidff->effect[slot].image_report[index] = report;
+	__set_bit(index, &pidff->effect[slot].image_valid);
+}
+
+/*
+ * Put image index of the effect in slot back into its report fields.
+ * Returns the report.
+ */
+static int pidff_load_image(struct pidff_device *pidff, int slot, int index)
+{
+	int report = pidff->effect[slot].image_report[index];
+	struct hid_report *hid_report = pidff->reports[report];
+	s32 *values = pidff_image(pidff, slot, index);
+	int i;
+
+	for (i = 0; i < hid_report->maxfield; i++) {
+		memcpy(hid_report->field[i]->value, values,
+			hid_report->field[i]->report_count * sizeof(s32));
+		values += hid_report->field[i]->report_count;
+	}
+
+	return report;
+}
+
+/*
+ * Send parameter block n (1..) of the active effect
+ */
+static void pidff_send_param(struct pidff_device *pidff, int report, int n)
+{
+	if (pidff->image_slot >= 0)
+		pidff_save_image(pidff, pidff->image_slot, n, report);
+
+	pidff_send_report(pidff, report, pidff_param_key(pidff, n),
+		pidff->active.id);
+}
+
+/*
+ * Send envelope report to the device
+ */
+static int pidff_set_envelope_report(struct pidff_device *pidff,
+				      struct ff_envelope *envelope)
+{
+	int ret;
+
+	if (IS_DEVICE_MANAGED(pidff))
+		pidff->set_envelope[PID_EFFECT_BLOCK_INDEX].value[0] =
+		    pidff->active.id;
+
+	pidff->set_envelope[PID_ATTACK_LEVEL].value[0] =
+	    pidff_scale(pidff->set_envelope[PID_ATTACK_LEVEL].
+		scale[PID_SCALE_POSITIVE], envelope->attack_level >
+		0x7fff ? 0x7fff : envelope->attack_level, 0x7fff,
+		pidff->set_envelope[PID_ATTACK_LEVEL].field);
+	pidff->set_envelope[PID_FADE_LEVEL].value[0] =
+	    pidff_scale(pidff->set_envelope[PID_FADE_LEVEL].
+		scale[PID_SCALE_POSITIVE], envelope->fade_level >
+		0x7fff ? 0x7fff : envelope->fade_level, 0x7fff,
+		pidff->set_envelope[PID_FADE_LEVEL].field);
+
+	pidff->set_envelope[PID_ATTACK_TIME].value[0] = envelope->attack_length;
+	pidff->set_envelope[PID_FADE_TIME].value[0] = envelope->fade_length;
+
+#ifdef DEBUG_SCALING
+	hid_dbg(pidff->hid, "attack %u => %d\n",
+		envelope->attack_level,
+		pidff->set_envelope[PID_ATTACK_LEVEL].value[0]);
+#endif
+
+	if (!IS_DEVICE_MANAGED(pidff)) {
+		ret = pidff_param_block(pidff, PID_SET_ENVELOPE, 2);
+		if (ret <= 0)
+			return ret ? -ENOSPC : 0;
+	}
+
+	pidff_send_param(pidff, PID_SET_ENVELOPE, 2);
+	return 0;
+}
+
+/*
+ * Test if the new envelope differs from old one
+ */
+static int pidff_needs_set_envelope(struct ff_envelope *envelope,
+				    struct ff_envelope *old)
+{
+	return envelope->attack_level != old->attack_level ||
+	       envelope->fade_level != old->fade_level ||
+	       envelope->attack_length != old->attack_length ||
+	       envelope->fade_length != old->fade_length;
+}
+
+/*
+ * Send constant force report to the device
+ */
+static int pidff_set_constant_force_report(struct pidff_device *pidff,
+					    struct ff_effect *effect)
+{
+	int ret;
+
+	if (IS_DEVICE_MANAGED(pidff))
+		pidff->set_constant[PID_EFFECT_BLOCK_INDEX].value[0] =
+			pidff->active.id;
+
+	pidff_set_signed(&pidff->set_constant[PID_MAGNITUDE],
+		effect->u.constant.level);
+
+	if (!IS_DEVICE_MANAGED(pidff)) {
+		ret = pidff_param_block(pidff, PID_SET_CONSTANT, 1);
+		if (ret <= 0)
+			return ret ? -ENOSPC : 0;
+	}
+
+	pidff_send_param(pidff, PID_SET_CONSTANT, 1);
+	return 0;
+}
+
+/*
+ * Test if the constant parameters have changed between effects
+ */
+static int pidff_needs_set_constant(struct ff_effect *effect,
+				    struct ff_effect *old)
+{
+	return effect->u.constant.level != old->u.constant.level;
+}
+
+/*
+ * Send set effect report to the device
+ */
+static void pidff_set_effect_report(struct pidff_device *pidff,
+				    struct ff_effect *effect)
+{
+	int i;
+
+	pidff->set_effect[PID_EFFECT_BLOCK_INDEX].value[0] =
 		pidff->active.id;
 
-	if (IS_DEVICE_MANAGED(pidff)) {
-		pidff->set_effect_type->value[0] =
-			pidff->create_new_effect_type->value[0];
-	} else {
-		pidff->set_effect_type->value[0] = pidff->active.effect_type_id;
+	/* Both type fields have the same usages, checked at init */
+	pidff->set_effect_type->value[0] = pidff->active.effect_type_id;
+
+	if (!IS_DEVICE_MANAGED(pidff)) {
 		if (pidff->active.offset[0]) {
 			pidff->block_offset[0].value[0] = pidff->active.
 				offset[0]->block_offset;
@@ -795,14 +2428,17 @@ static void pidff_set_effect_report(struct pidff_device *pidff,
 	} else {
 		pidff->set_effect[PID_DIRECTION_ENABLE].value[0] = 1;
 		pidff->effect_direction->value[0] =
-			pidff_rescale(effect->direction, 0xffff,
+			pidff_scale(pidff->direction_scale[PID_SCALE_FULL],
+				effect->direction, 0xffff,
 				pidff->effect_direction);
 	}
 
 	pidff->set_effect[PID_START_DELAY].value[0] = effect->replay.delay;
 
-	hid_hw_request(pidff->hid, pidff->reports[PID_SET_EFFECT],
-		HID_REQ_SET_REPORT);
+	if (pidff->image_slot >= 0)
+		pidff_save_image(pidff, pidff->image_slot, 0, PID_SET_EFFECT);
+	pidff_send_report(pidff, PID_SET_EFFECT, pidff->active.id,
+		pidff->active.id);
 }
 
 /*
@@ -818,26 +2454,71 @@ static int pidff_needs_set_effect(struct ff_effect *effect,
 	       effect->replay.delay != old->replay.delay;
 }
 
+/*
+ * Send the saved images of the effect in slot instead of building the
+ * reports again, only fixing up where the effect lives on the device.
+ * Parameter blocks are sent too if params is set. Returns 0 if the images
+ * do not make up the whole effect, or for parameter blocks of the driver
+ * managed pool, which are not sent for blocks shared with other effects.
+ */
+static int pidff_restore_effect(struct pidff_device *pidff, int slot,
+				int params)
+{
+	struct pidff_info *info = &pidff->effect[slot];
+	struct pidff_usage *usage;
+	int report, count, n, i;
+
+	if (!pidff->images || !info->image_ok ||
+	    !test_bit(0, &info->image_valid) ||
+	    (params && !IS_DEVICE_MANAGED(pidff)))
+		return 0;
+
+	/* The device managed pool wants to hear of the effect first */
+	if (IS_DEVICE_MANAGED(pidff)) {
+		pidff_load_image(pidff, slot, 0);
+		pidff->set_effect[PID_EFFECT_BLOCK_INDEX].value[0] =
+			pidff->active.id;
+		pidff_send_report(pidff, PID_SET_EFFECT, pidff->active.id,
+			pidff->active.id);
+	}
+
+	for (n = 1; n < PID_IMAGES && params; n++) {
+		if (!test_bit(n, &info->image_valid))
+			continue;
+
+		report = pidff_load_image(pidff, slot, n);
+		usage = pidff_param_usage(pidff, report, &count);
+		usage[PID_EFFECT_BLOCK_INDEX].value[0] = pidff->active.id;
+		pidff_send_report(pidff, report, pidff_param_key(pidff, n),
+			pidff->active.id);
+	}
+
+	if (!IS_DEVICE_MANAGED(pidff)) {
+		pidff_load_image(pidff, slot, 0);
+		pidff->set_effect[PID_EFFECT_BLOCK_INDEX].value[0] =
+			pidff->active.id;
+		for (i = 0; i < PID_AXES_MAX; i++)
+			pidff->block_offset[i].value[0] = info->offset[i] ?
+				info->offset[i]->block_offset : 0;
+		pidff_send_report(pidff, PID_SET_EFFECT, pidff->active.id,
+			pidff->active.id);
+	}
+
+	pidff->image_restores++;
+	return 1;
+}
+
 /*
  * Send periodic effect report to the device
  */
 static int pidff_set_periodic_report(struct pidff_device *pidff,
 				      struct ff_effect *effect)
 {
-	int offset;
+	int ret;
 
-	if (IS_DEVICE_MANAGED(pidff)) {
+	if (IS_DEVICE_MANAGED(pidff))
 		pidff->set_periodic[PID_EFFECT_BLOCK_INDEX].value[0] =
 			pidff->active.id;
-	} else {
-		offset = pidff_get_or_allocate_block(pidff, pidff->active.id,
-			pidff_report_store_size(pidff,
-			PID_SET_PERIODIC), 1);
-		if (offset < 0)
-			return -ENOSPC;
-
-		pidff->set_periodic[PID_PARAM_BLOCK_OFFSET].value[0] = offset;
-	}
 
 	pidff_set_signed(&pidff->set_periodic[PID_MAGNITUDE],
 		effect->u.periodic.magnitude);
@@ -846,8 +2527,13 @@ static int pidff_set_periodic_report(struct pidff_device *pidff,
 	pidff_set(&pidff->set_periodic[PID_PHASE], effect->u.periodic.phase);
 	pidff->set_periodic[PID_PERIOD].value[0] = effect->u.periodic.period;
 
-	hid_hw_request(pidff->hid, pidff->reports[PID_SET_PERIODIC],
-		HID_REQ_SET_REPORT);
+	if (!IS_DEVICE_MANAGED(pidff)) {
+		ret = pidff_param_block(pidff, PID_SET_PERIODIC, 1);
+		if (ret <= 0)
+			return ret ? -ENOSPC : 0;
+	}
+
+	pidff_send_param(pidff, PID_SET_PERIODIC, 1);
 	return 0;
 }
 
@@ -869,26 +2555,16 @@ static int pidff_needs_set_periodic(struct ff_effect *effect,
 static int pidff_set_condition_report(struct pidff_device *pidff,
 				       struct ff_effect *effect)
 {
-	int i, offset;
+	int i, ret;
 
 	if (IS_DEVICE_MANAGED(pidff))
 		pidff->set_condition[PID_EFFECT_BLOCK_INDEX].value[0] =
 			pidff->active.id;
 
 	for (i = 0; i < 2; i++) {
-		if (IS_DEVICE_MANAGED(pidff)) {
+		if (IS_DEVICE_MANAGED(pidff))
 			pidff->set_condition[PID_PARAM_BLOCK_OFFSET].value[0] =
 				i;
-		} else {
-			offset = pidff_get_or_allocate_block(pidff,
-				pidff->active.id, pidff_report_store_size(pidff,
-				PID_SET_CONDITION), i+1);
-			if (offset < 0)
-				return -ENOSPC;
-
-			pidff->set_condition[PID_PARAM_BLOCK_OFFSET].value[0] =
-				offset;
-		}
 
 		pidff_set_signed(&pidff->set_condition[PID_CP_OFFSET],
 			effect->u.condition[i].center);
@@ -903,9 +2579,19 @@ static int pidff_set_condition_report(struct pidff_device *pidff,
 		pidff_set(&pidff->set_condition[PID_DEAD_BAND],
 			effect->u.condition[i].deadband);
 
-		hid_hw_request(pidff->hid, pidff->reports[PID_SET_CONDITION],
-			HID_REQ_SET_REPORT);
-		hid_hw_wait(pidff->hid);
+		if (!IS_DEVICE_MANAGED(pidff)) {
+			ret = pidff_param_block(pidff, PID_SET_CONDITION,
+				i + 1);
+			if (ret < 0)
+				return -ENOSPC;
+			if (!ret)
+				continue;
+		}
+
+		/* The report contents are copied when queued, so the second
+		 * axis can be queued right behind the first one
+		 */
+		pidff_send_param(pidff, PID_SET_CONDITION, i + 1);
 	}
 	return 0;
 }
@@ -940,27 +2626,23 @@ static int pidff_needs_set_condition(struct ff_effect *effect,
 static int pidff_set_ramp_force_report(struct pidff_device *pidff,
 					struct ff_effect *effect)
 {
-	int offset;
+	int ret;
 
-	if (IS_DEVICE_MANAGED(pidff)) {
+	if (IS_DEVICE_MANAGED(pidff))
 		pidff->set_ramp[PID_EFFECT_BLOCK_INDEX].value[0] =
 			pidff->active.id;
-	} else {
-		offset = pidff_get_or_allocate_block(pidff, pidff->active.id,
-			pidff_report_store_size(pidff, PID_SET_RAMP),
-			1);
-		if (offset < 0)
-			return -ENOSPC;
-
-		pidff->set_ramp[PID_PARAM_BLOCK_OFFSET].value[0] = offset;
-	}
 
 	pidff_set_signed(&pidff->set_ramp[PID_RAMP_START],
 		 effect->u.ramp.start_level);
 	pidff_set_signed(&pidff->set_ramp[PID_RAMP_END],
 		 effect->u.ramp.end_level);
-	hid_hw_request(pidff->hid, pidff->reports[PID_SET_RAMP],
-		HID_REQ_SET_REPORT);
+
+	if (!IS_DEVICE_MANAGED(pidff)) {
+		ret = pidff_param_block(pidff, PID_SET_RAMP, 1);
+		if (ret <= 0)
+			return ret ? -ENOSPC : 0;
+	}
+	pidff_send_param(pidff, PID_SET_RAMP, 1);
 	return 0;
 }
 
@@ -973,44 +2655,134 @@ static int pidff_needs_set_ramp(struct ff_effect *effect, struct ff_effect *old)
 	       effect->u.ramp.end_level != old->u.ramp.end_level;
 }
 
+/*
+ * Send all parameter block reports of an effect
+ */
+static int pidff_set_parameter_reports(struct pidff_device *pidff,
+				       struct ff_effect *effect)
+{
+	struct ff_envelope *envelope = NULL;
+	int error;
+
+	switch (effect->type) {
+	case FF_CONSTANT:
+		error = pidff_set_constant_force_report(pidff, effect);
+		envelope = &effect->u.constant.envelope;
+		break;
+
+	case FF_PERIODIC:
+		error = pidff_set_periodic_report(pidff, effect);
+		envelope = &effect->u.periodic.envelope;
+		break;
+
+	case FF_RAMP:
+		error = pidff_set_ramp_force_report(pidff, effect);
+		envelope = &effect->u.ramp.envelope;
+		break;
+
+	case FF_SPRING:
+	case FF_FRICTION:
+	case FF_DAMPER:
+	case FF_INERTIA:
+		error = pidff_set_condition_report(pidff, effect);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	if (!error && envelope)
+		error = pidff_set_envelope_report(pidff, envelope);
+
+	return error;
+}
+
+/*
+ * Account an answered block load request
+ */
+static void pidff_block_load_done(struct pidff_device *pidff, int polls,
+		ktime_t start)
+{
+	unsigned int us = ktime_us_delta(ktime_get(), start);
+	int bucket = 0;
+
+	pidff->block_load_polls[min(polls, PID_BLOCK_LOAD_POLL_BUCKETS) - 1]++;
+
+	while (bucket < PID_BLOCK_LOAD_TIME_BUCKETS - 1 &&
+		us >= (250U << bucket))
+		bucket++;
+	pidff->block_load_us[bucket]++;
+
+	if (pidff->block_load_samples < PID_BLOCK_LOAD_SAMPLES)
+		pidff->block_load_samples++;
+
+	/* Moving average with a weight of 1/8 */
+	if (pidff->block_load_avg_us)
+		pidff->block_load_avg_us += ((int)us -
+			(int)pidff->block_load_avg_us) / 8;
+	else
+		pidff->block_load_avg_us = us;
+}
+
 /*
  * Send a request for effect upload to the device
  *
  * Returns 0 if device reported success, -ENOSPC if the device reported memory
- * is full. Upon unknown response the function will retry for 60 times, if
- * still unsuccessful -EIO is returned.
+ * is full. Upon unknown response the block load report is requested again,
+ * once right away and then with a growing delay, until a timeout derived from
+ * the usual creation time. Until that time is known, the request is repeated
+ * at least PID_BLOCK_LOAD_RETRIES times. After that -EIO is returned.
  */
 static int pidff_request_effect_upload(struct pidff_device *pidff, int efnum)
 {
+	struct pidff_info *info;
+	unsigned int timeout, delay = 250;
+	ktime_t start;
 	int j;
 
 	if (IS_DEVICE_MANAGED(pidff)) {
+		start = ktime_get();
+		timeout = clamp_t(unsigned int, pidff->block_load_avg_us * 4,
+			PID_BLOCK_LOAD_TIMEOUT_MIN, PID_BLOCK_LOAD_TIMEOUT_MAX);
+		/* Nothing to go by yet, allow as much as ever */
+		if (pidff->block_load_samples < PID_BLOCK_LOAD_SAMPLES)
+			timeout = PID_BLOCK_LOAD_TIMEOUT_MAX;
+
+		/*
+		 * A feature report, not for the output queue. It goes after
+		 * everything waiting, and before the block load is polled.
+		 */
+		pidff_sched_run(pidff, 1);
 		pidff->create_new_effect_type->value[0] = efnum;
-		hid_hw_request(pidff->hid,
-			pidff->reports[PID_CREATE_NEW_EFFECT],
+		hid_hw_request(pidff->hid, pidff->reports[PID_CREATE_NEW_EFFECT],
 			HID_REQ_SET_REPORT);
 		hid_dbg(pidff->hid, "create_new_effect sent, type: %d\n",
 			efnum);
 
 		pidff->block_load[PID_EFFECT_BLOCK_INDEX].value[0] = 0;
 		pidff->block_load_status->value[0] = 0;
-		hid_hw_wait(pidff->hid);
+		pidff_wait(pidff);
 
-		for (j = 0; j < 60; j++) {
+		for (j = 1; ; j++) {
 			hid_dbg(pidff->hid, "pid_block_load requested\n");
+			/* hid_hw_wait() returns once the answer is in */
 			hid_hw_request(pidff->hid,
 				pidff->reports[PID_BLOCK_LOAD],
 				HID_REQ_GET_REPORT);
-			hid_hw_wait(pidff->hid);
+			pidff_wait(pidff);
 			if (pidff->block_load_status->value[0] ==
 				pidff->status_id[PID_BLOCK_LOAD_SUCCESS]) {
 				hid_dbg(pidff->hid, "device reported free memory: %d bytes\n",
 					pidff->block_load[PID_RAM_POOL_AVAILABLE].value ?
 					pidff->block_load[PID_RAM_POOL_AVAILABLE].value[0] : -1);
 
+				pidff_block_load_done(pidff, j, start);
 				pidff->active.id = pidff->
 					block_load[PID_EFFECT_BLOCK_INDEX].
 					value[0];
+				pidff->active.effect_type_id = efnum;
+				pidff_map_effect(pidff, pidff->active.id,
+					pidff->active_effect_id, efnum);
 				return 0;
 			}
 			if (pidff->block_load_status->value[0] ==
@@ -1018,121 +2790,478 @@ static int pidff_request_effect_upload(struct pidff_device *pidff, int efnum)
 				hid_dbg(pidff->hid, "not enough memory free: %d bytes\n",
 					pidff->block_load[PID_RAM_POOL_AVAILABLE].value ?
 					pidff->block_load[PID_RAM_POOL_AVAILABLE].value[0] : -1);
+				pidff_block_load_done(pidff, j, start);
 				return -ENOSPC;
 			}
+
+			if (ktime_us_delta(ktime_get(), start) >= timeout &&
+				(pidff->block_load_samples >=
+				PID_BLOCK_LOAD_SAMPLES ||
+				j >= PID_BLOCK_LOAD_RETRIES))
+				break;
+
+			/* Retry once right away, then back off */
+			if (j > 1) {
+				usleep_range(delay, delay * 2);
+				delay = min_t(unsigned int, delay * 2,
+					PID_BLOCK_LOAD_BACKOFF_MAX);
+			}
 		}
-		hid_err(pidff->hid, "pid_block_load failed 60 times\n");
+		hid_err(pidff->hid, "pid_block_load failed %d times in %u us\n",
+			j, timeout);
 
 	} else {
 		/* Driver managed mode, allocate a new id if any is available */
-		for (j = 0; j < pidff->max_effects; j++) {
-			if (pidff->effect[j].id > -1)
-				continue;
+		info = &pidff->effect[pidff->active_effect_id];
+		if (info->reserved && info->reserved_id >= 0) {
+			/* Held for this effect since its async upload */
+			j = info->reserved_id;
+			info->reserved_id = -1;
+		} else {
+			j = find_first_zero_bit(pidff->pid_used,
+				pidff->max_effects);
+			if (j >= pidff->max_effects)
+				return -ENOSPC;
+		}
 
-			pidff->effect[pidff->active_effect_id].id =
-				pidff->active.id = j;
-			pidff->effect[pidff->active_effect_id].offset[0] = NULL;
-			pidff->effect[pidff->active_effect_id].offset[1] = NULL;
-			pidff->effect[pidff->active_effect_id].effect_type_id =
-				pidff->active.effect_type_id = efnum;
+		set_bit(j, pidff->pid_used);
+		pidff->active.id = j;
+		pidff->active.effect_type_id = efnum;
+		pidff_map_effect(pidff, j, pidff->active_effect_id, efnum);
 
-			hid_dbg(pidff->hid, "upload id %d\n", pidff->active.id);
-			return 0;
-		}
-		return -ENOSPC;
+		hid_dbg(pidff->hid, "upload id %d\n", pidff->active.id);
+		return 0;
 	}
 	return -EIO;
 }
 
 /*
- * Play the effect with PID id n times
+ * Play the effect with PID id n times
+ */
+static void pidff_playback_pid(struct pidff_device *pidff, int pid_id, int n)
+{
+	pidff->effect_operation[PID_EFFECT_BLOCK_INDEX].value[0] = pid_id;
+
+	if (n == 0) {
+		pidff->effect_operation_status->value[0] =
+			pidff->operation_id[PID_EFFECT_STOP];
+	} else {
+		pidff->effect_operation_status->value[0] =
+			pidff->operation_id[PID_EFFECT_START];
+		pidff->effect_operation[PID_LOOP_COUNT].value[0] = n;
+	}
+
+	/*
+	 * A start waits for the parameters of the effect, and a stop for
+	 * a start still waiting, so that they reach the device in order
+	 */
+	pidff_submit(pidff, PID_EFFECT_OPERATION, pid_id);
+}
+
+/*
+ * Jiffies until an effect played count times ends. The input core allows
+ * any count, the product is widened and clamped so that it cannot wrap.
+ */
+static unsigned long pidff_play_time(struct pidff_info *info, int count)
+{
+	u64 ms = (u64)count * ((u64)info->effect.replay.delay +
+		info->effect.replay.length);
+
+	return msecs_to_jiffies(min_t(u64, ms, UINT_MAX));
+}
+
+/**
+ * Play the effect with effect id @effect_id for @value times
+ */
+static int pidff_playback(struct input_dev *dev, int effect_id, int value)
+{
+	struct pidff_device *pidff = dev->ff->private;
+	struct pidff_info *info = &pidff->effect[effect_id];
+	unsigned long flags;
+	int stopped;
+
+	spin_lock_irqsave(&pidff->lock, flags);
+
+	stopped = pidff_effect_stopped(pidff, effect_id);
+	info->last_used = jiffies;
+	if (value) {
+		info->playing = 1;
+		info->play_until = jiffies + pidff_play_time(info, value);
+	} else {
+		info->playing = 0;
+	}
+
+	if (!value && stopped) {
+		/* Stopped already, nothing to stop */
+		pidff->stops_elided++;
+	} else if (info->resident) {
+		pidff_playback_pid(pidff, info->id, value);
+	} else if (value) {
+		/* Uploading sleeps, leave it to the swap work */
+		info->swap_count = value;
+		set_bit(effect_id, pidff->swap_pending);
+		pidff_queue_work(pidff, &pidff->swap_work);
+	} else {
+		/* A pending load still goes ahead */
+		info->swap_count = 0;
+	}
+
+	spin_unlock_irqrestore(&pidff->lock, flags);
+
+	return 0;
+}
+
+/*
+ * Forget what was sent for the device effect with PID id
+ */
+static void pidff_shadow_forget_pid(struct pidff_device *pidff, int pid_id)
+{
+	int i;
+
+	pidff_shadow_forget(pidff, PID_SET_EFFECT, pid_id);
+
+	/* Blocks of the driver managed pool are forgotten with the blocks */
+	if (!IS_DEVICE_MANAGED(pidff))
+		return;
+
+	for (i = PID_SET_ENVELOPE; i <= PID_SET_RAMP; i++) {
+		pidff_shadow_forget(pidff, i, pid_id * PID_AXES_MAX);
+		pidff_shadow_forget(pidff, i, pid_id * PID_AXES_MAX + 1);
+	}
+}
+
+/*
+ * Erase effect with PID id
+ */
+static void pidff_erase_pid(struct pidff_device *pidff, int pid_id)
+{
+	struct pidff_info *info;
+	int slot, i;
+
+	pidff_shadow_forget_pid(pidff, pid_id);
+
+	if (IS_DEVICE_MANAGED(pidff)) {
+		pidff->block_free[PID_EFFECT_BLOCK_INDEX].value[0] = pid_id;
+		pidff_submit(pidff, PID_BLOCK_FREE, pid_id);
+	} else {
+		slot = pidff_find_effect(pidff, pid_id);
+		if (slot < 0)
+			return;
+		info = &pidff->effect[slot];
+
+		pidff_hold_reports(pidff);
+		for (i = 0; i < PID_AXES_MAX; i++) {
+			if (!info->offset[i])
+				continue;
+#ifdef DEBUG_MEM_ALLOC
+			hid_dbg(pidff->hid, "Block erased at 0x%x\n",
+				info->offset[i]->block_offset);
+#endif
+			pidff_free_memory_block(pidff, info->offset[i]);
+		}
+		pidff_release_reports(pidff);
+		clear_bit(pid_id, pidff->pid_used);
+	}
+
+	pidff_unmap_effect(pidff, pid_id);
+}
+
+/*
+ * Parameter blocks used by an effect type. Types sharing them can replace
+ * each other on the device.
+ */
+static int pidff_param_layout(int type)
+{
+	switch (type) {
+	case FF_SPRING:
+	case FF_FRICTION:
+	case FF_DAMPER:
+	case FF_INERTIA:
+		return FF_SPRING;
+	default:
+		return type;
+	}
+}
+
+/*
+ * Take over a tombstoned device effect of the same type, instead of having
+ * the device create a new one. With retype set, one of another type with
+ * the same parameter blocks will do, which the PID specification does not
+ * promise to work on every device. Returns 1 if one was found.
+ */
+static int pidff_revive_effect(struct pidff_device *pidff,
+			       struct ff_effect *effect, int efnum)
+{
+	int layout = pidff_param_layout(effect->type);
+	int pid_id;
+
+	for_each_set_bit(pid_id, pidff->erase_pending, PID_EFFECTS_MAX + 1) {
+		if (pidff->erase_type[pid_id] != efnum &&
+			(!pidff_retype || pidff->erase_layout[pid_id] != layout))
+			continue;
+
+		clear_bit(pid_id, pidff->erase_pending);
+		pidff_shadow_forget_pid(pidff, pid_id);
+		pidff->active.id = pid_id;
+		pidff->active.effect_type_id = efnum;
+		pidff_map_effect(pidff, pid_id, pidff->active_effect_id, efnum);
+		pidff->revived++;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Free the device slots of tombstoned effects. Runs before an effect is
+ * created, so that the space is available to it.
+ */
+static void pidff_flush_erases(struct pidff_device *pidff)
+{
+	int pid_id, n = 0;
+
+	for_each_set_bit(pid_id, pidff->erase_pending, PID_EFFECTS_MAX + 1) {
+		clear_bit(pid_id, pidff->erase_pending);
+		pidff_erase_pid(pidff, pid_id);
+		n++;
+	}
+
+	if (n)
+		pidff->erase_batches++;
+}
+
+/*
+ * Hold a device slot for an effect uploaded asynchronously, so that a full
+ * device fails the upload itself rather than the swap work later. With
+ * virtual effects a full device only keeps the effect on the host, nothing
+ * is held then. Call with the ff mutex held.
+ */
+static int pidff_reserve_slot(struct pidff_device *pidff, int slot)
+{
+	struct pidff_info *info = &pidff->effect[slot];
+	int i, used;
+
+	if (pidff->nr_effects > pidff->max_effects)
+		return 0;
+
+	info->reserved_id = -1;
+	if (IS_DEVICE_MANAGED(pidff)) {
+		/* The device hands out the ids, only count its slots */
+		used = pidff->nr_reserved;
+		for (i = 0; i < pidff->nr_effects; i++)
+			used += pidff->effect[i].resident;
+		if (used >= pidff->max_effects)
+			return -ENOSPC;
+	} else {
+		i = find_first_zero_bit(pidff->pid_used, pidff->max_effects);
+		if (i >= pidff->max_effects)
+			return -ENOSPC;
+		set_bit(i, pidff->pid_used);
+		info->reserved_id = i;
+	}
+
+	info->reserved = 1;
+	pidff->nr_reserved++;
+	return 0;
+}
+
+/*
+ * Give back the device slot held for an effect, once it is loaded or gone.
+ * Call with the ff mutex held.
+ */
+static void pidff_release_slot(struct pidff_device *pidff, int slot)
+{
+	struct pidff_info *info = &pidff->effect[slot];
+
+	if (!info->reserved)
+		return;
+
+	/* Not taken by a load */
+	if (info->reserved_id >= 0)
+		clear_bit(info->reserved_id, pidff->pid_used);
+	info->reserved_id = -1;
+	info->reserved = 0;
+	pidff->nr_reserved--;
+}
+
+/*
+ * Stop and erase effect with effect_id
+ */
+static int pidff_erase_effect(struct input_dev *dev, int effect_id)
+{
+	struct pidff_device *pidff = dev->ff->private;
+	struct pidff_info *info = &pidff->effect[effect_id];
+	int pid_id = info->id;
+	unsigned long flags;
+
+	hid_dbg(pidff->hid, "starting to erase %d/%d\n",
+		effect_id, pidff->effect[effect_id].id);
+
+	/* The device forgot everything when it went away */
+	if (pidff->dead)
+		return 0;
+
+	pidff_release_slot(pidff, effect_id);
+	spin_lock_irqsave(&pidff->lock, flags);
+	clear_bit(effect_id, pidff->swap_pending);
+	info->uploaded = 0;
+	info->stream_dirty = 0;
+	info->image_ok = 0;
+	if (pid_id >= 0 && !pidff_effect_stopped(pidff, effect_id))
+		pidff_playback_pid(pidff, pid_id, 0);
+	else if (pid_id >= 0)
+		pidff->stops_elided++;
+	spin_unlock_irqrestore(&pidff->lock, flags);
+	info->update_pending = 0;
+
+	/* Evicted effects only live on the host */
+	if (pid_id < 0)
+		return 0;
+
+	if (!IS_DEVICE_MANAGED(pidff)) {
+		/* The blocks are ours, they can be reused right away */
+		pidff_erase_pid(pidff, pid_id);
+		return 0;
+	}
+
+	/*
+	 * Leave a tombstone and free the device slot a little later, together
+	 * with the others erased meanwhile. The effect slot is free at once.
+	 * This is done whether or not the async option is set, erases never
+	 * wait for the device.
+	 */
+	pidff->erase_layout[pid_id] = pidff_param_layout(info->effect.type);
+	pidff->erase_type[pid_id] = info->effect_type_id;
+	pidff_unmap_effect(pidff, pid_id);
+	set_bit(pid_id, pidff->erase_pending);
+	pidff_queue_delayed(pidff, &pidff->erase_work,
+		msecs_to_jiffies(PID_ERASE_DELAY));
+	pidff->deferred_erases++;
+
+	return 0;
+}
+
+/*
+ * Start the autocenter spring of the device with magnitude, or stop it.
+ * The reports are built under the device lock like those of the effects.
  */
-static void pidff_playback_pid(struct pidff_device *pidff, int pid_id, int n)
+static void pidff_autocenter(struct pidff_device *pidff, u16 magnitude)
 {
-	pidff->effect_operation[PID_EFFECT_BLOCK_INDEX].value[0] = pid_id;
+	struct hid_field *field;
+	unsigned long flags;
 
-	if (n == 0) {
-		pidff->effect_operation_status->value[0] =
-			pidff->operation_id[PID_EFFECT_STOP];
-	} else {
-		pidff->effect_operation_status->value[0] =
-			pidff->operation_id[PID_EFFECT_START];
-		pidff->effect_operation[PID_LOOP_COUNT].value[0] = n;
-	}
+	spin_lock_irqsave(&pidff->lock, flags);
+	pidff->autocenter = magnitude;
+
+	if (IS_DEVICE_MANAGED(pidff)) {
+		field = pidff->block_load[PID_EFFECT_BLOCK_INDEX].field;
+
+		if (!magnitude) {
+			pidff_playback_pid(pidff, field->logical_minimum, 0);
+			goto out;
+		}
+
+		pidff_playback_pid(pidff, field->logical_minimum, 1);
+
+		pidff->set_effect[PID_EFFECT_BLOCK_INDEX].value[0] =
+			pidff->block_load[PID_EFFECT_BLOCK_INDEX].field->
+			logical_minimum;
+
+		pidff->set_effect_type->value[0] = pidff->type_id[PID_SPRING];
+
+		pidff->set_effect[PID_DURATION].value[0] = 0;
+		pidff->set_effect[PID_TRIGGER_BUTTON].value[0] = 0;
+		pidff->set_effect[PID_TRIGGER_REPEAT_INT].value[0] = 0;
+		pidff_set(&pidff->set_effect_optional[PID_GAIN], magnitude);
+		pidff->set_effect[PID_DIRECTION_ENABLE].value[0] = 1;
+		pidff->set_effect[PID_START_DELAY].value[0] = 0;
 
-	hid_hw_request(pidff->hid, pidff->reports[PID_EFFECT_OPERATION],
-		HID_REQ_SET_REPORT);
+		pidff_send_report(pidff, PID_SET_EFFECT, field->logical_minimum,
+			field->logical_minimum);
+	}
+out:
+	spin_unlock_irqrestore(&pidff->lock, flags);
 }
 
-/**
- * Play the effect with effect id @effect_id for @value times
+/*
+ * Send a device control command. Call with the device lock held.
  */
-static int pidff_playback(struct input_dev *dev, int effect_id, int value)
+static int pidff_device_command(struct pidff_device *pidff, int command)
 {
-	struct pidff_device *pidff = dev->ff->private;
-
-	pidff_playback_pid(pidff, pidff->effect[effect_id].id, value);
+	if (!pidff->control_id[command])
+		return -EOPNOTSUPP;
 
+	pidff->device_control->value[0] = pidff->control_id[command];
+	pidff_submit(pidff, PID_DEVICE_CONTROL, -1);
 	return 0;
 }
 
 /*
- * Erase effect with PID id
+ * Stop all effects with a single report. Call with the ff mutex held.
  */
-static void pidff_erase_pid(struct pidff_device *pidff, int pid_id)
+static int pidff_stop_all(struct pidff_device *pidff)
 {
-	struct list_head *pos, *temp;
-	struct pidff_memory_block *block;
-
-	if (IS_DEVICE_MANAGED(pidff)) {
-		pidff->block_free[PID_EFFECT_BLOCK_INDEX].value[0] = pid_id;
-		hid_hw_request(pidff->hid, pidff->reports[PID_BLOCK_FREE],
-			HID_REQ_SET_REPORT);
+	struct pidff_info *info;
+	unsigned long flags;
+	int error, i;
+
+	if (!pidff->control_id[PID_STOP_ALL_EFFECTS])
+		return -EOPNOTSUPP;
+
+	/* Starts still waiting behind their parameters must not come after */
+	pidff_sched_run(pidff, 1);
+
+	spin_lock_irqsave(&pidff->lock, flags);
+	error = pidff_device_command(pidff, PID_STOP_ALL_EFFECTS);
+	/* Their stops are elided from now on, until they are started again */
+	for (i = 0; i < pidff->nr_effects; i++) {
+		info = &pidff->effect[i];
+		info->playing = 0;
+		/* A pending load still goes ahead */
+		info->swap_count = 0;
+	}
+	pidff->stop_all_sent++;
+	spin_unlock_irqrestore(&pidff->lock, flags);
 
-	} else {
-		list_for_each_safe(pos, temp, &pidff->memory) {
-			block = list_entry(pos, struct pidff_memory_block, list);
+	/* The autocenter spring was stopped as well, it has to keep going */
+	if (!error && pidff->autocenter &&
+	    test_bit(FF_AUTOCENTER, pidff->input->ffbit))
+		pidff_autocenter(pidff, pidff->autocenter);
 
-			if (block->block_index == pid_id) {
-#ifdef DEBUG_MEM_ALLOC
-				hid_dbg(pidff->hid, "Block erased at 0x%x\n", block->block_offset);
-#endif
-				pidff_free_memory_block(pidff, block);
-			}
-		}
-	}
+	return error;
 }
 
 /*
- * Stop and erase effect with effect_id
+ * Stop the effects of a closing client with one report when nobody else
+ * has effects playing. The input core then stops and erases them one by
+ * one, which no longer needs to reach the device.
  */
-static int pidff_erase_effect(struct input_dev *dev, int effect_id)
+static int pidff_flush(struct input_dev *dev, struct file *file)
 {
 	struct pidff_device *pidff = dev->ff->private;
-	int pid_id = pidff->effect[effect_id].id;
-
-	hid_dbg(pidff->hid, "starting to erase %d/%d\n",
-		effect_id, pidff->effect[effect_id].id);
-	/* Wait for the queue to clear. We do not want a full fifo to
-	   prevent the effect removal. */
-	hid_hw_wait(pidff->hid);
-	pidff_playback_pid(pidff, pid_id, 0);
-	pidff_erase_pid(pidff, pid_id);
+	struct ff_device *ff = dev->ff;
+	int i, owned = 0;
 
-	pidff->effect[effect_id].id = -1;
-	pidff->effect[effect_id].offset[0] = NULL;
-	pidff->effect[effect_id].offset[1] = NULL;
+	mutex_lock(&ff->mutex);
+	for (i = 0; i < pidff->nr_effects; i++) {
+		if (!pidff->effect[i].playing)
+			continue;
+		if (ff->effect_owners[i] != file)
+			break;
+		owned++;
+	}
+	if (i == pidff->nr_effects && owned)
+		pidff_stop_all(pidff);
+	mutex_unlock(&ff->mutex);
 
-	return 0;
+	return pidff->flush(dev, file);
 }
 
-/*
- * Effect upload handler
- */
-static int pidff_upload_effect(struct input_dev *dev, struct ff_effect *effect,
-			       struct ff_effect *old)
+static int __pidff_load_effect(struct pidff_device *pidff,
+			       struct ff_effect *effect, struct ff_effect *old)
 {
-	struct pidff_device *pidff = dev->ff->private;
+	struct pidff_info *info = &pidff->effect[effect->id];
+	unsigned long flags;
 	int type_id = 0;
 	int error = 0;
 	int needs_set_effect = 0;
@@ -1144,6 +3273,8 @@ static int pidff_upload_effect(struct input_dev *dev, struct ff_effect *effect,
 	pidff->active_effect_id = effect->id;
 	if (old) {
 		pidff->active.id = pidff->effect[effect->id].id;
+		pidff->active.effect_type_id =
+			pidff->effect[effect->id].effect_type_id;
 		pidff->active.offset[0] = pidff->effect[effect->id].offset[0];
 		pidff->active.offset[1] = pidff->effect[effect->id].offset[1];
 
@@ -1173,27 +3304,25 @@ static int pidff_upload_effect(struct input_dev *dev, struct ff_effect *effect,
 		break;
 
 	case FF_PERIODIC:
-		if (!old) {
-			switch (effect->u.periodic.waveform) {
-			case FF_SQUARE:
-				type_id = PID_SQUARE;
-				break;
-			case FF_TRIANGLE:
-				type_id = PID_TRIANGLE;
-				break;
-			case FF_SINE:
-				type_id = PID_SINE;
-				break;
-			case FF_SAW_UP:
-				type_id = PID_SAW_UP;
-				break;
-			case FF_SAW_DOWN:
-				type_id = PID_SAW_DOWN;
-				break;
-			default:
-				hid_err(pidff->hid, "invalid waveform\n");
-				return -EINVAL;
-			}
+		switch (effect->u.periodic.waveform) {
+		case FF_SQUARE:
+			type_id = PID_SQUARE;
+			break;
+		case FF_TRIANGLE:
+			type_id = PID_TRIANGLE;
+			break;
+		case FF_SINE:
+			type_id = PID_SINE;
+			break;
+		case FF_SAW_UP:
+			type_id = PID_SAW_UP;
+			break;
+		case FF_SAW_DOWN:
+			type_id = PID_SAW_DOWN;
+			break;
+		default:
+			hid_err(pidff->hid, "invalid waveform\n");
+			return -EINVAL;
 		}
 
 		needs_set_report = pidff_needs_set_periodic;
@@ -1227,114 +3356,635 @@ static int pidff_upload_effect(struct input_dev *dev, struct ff_effect *effect,
 		set_report_func = pidff_set_condition_report;
 		type_id = PID_DAMPER;
 		break;
-
-	case FF_INERTIA:
-		needs_set_report = pidff_needs_set_condition;
-		set_report_func = pidff_set_condition_report;
-		type_id = PID_INERTIA;
+
+	case FF_INERTIA:
+		needs_set_report = pidff_needs_set_condition;
+		set_report_func = pidff_set_condition_report;
+		type_id = PID_INERTIA;
+		break;
+
+	default:
+		hid_err(pidff->hid, "invalid type\n");
+		return -EINVAL;
+	}
+
+	if (!old && (!IS_DEVICE_MANAGED(pidff) ||
+		!pidff_revive_effect(pidff, effect, pidff->type_id[type_id]))) {
+		/* Make the space of tombstoned effects available first */
+		if (IS_DEVICE_MANAGED(pidff))
+			pidff_flush_erases(pidff);
+
+		error = pidff_request_effect_upload(pidff,
+			pidff->type_id[type_id]);
+		if (error)
+			return error;
+	}
+
+	/* An evicted effect coming back is sent as it was */
+	if (!old && IS_DEVICE_MANAGED(pidff) &&
+		!memcmp(effect, &info->effect, sizeof(*effect)) &&
+		pidff_restore_effect(pidff, effect->id, 1))
+		goto loaded;
+
+	if (!old)
+		info->image_valid = 0;
+	info->image_ok = 0;
+	pidff->image_slot = effect->id;
+
+	if (needs_set_effect && IS_DEVICE_MANAGED(pidff))
+		pidff_set_effect_report(pidff, effect);
+
+	if ((!old ||
+		(needs_set_report && (*needs_set_report)(effect, old))) &&
+		set_report_func) {
+		error = (*set_report_func)(pidff, effect);
+		if (error)
+			goto fail;
+	}
+
+	if (envelope &&	(!old ||
+		pidff_needs_set_envelope(envelope, old_envelope))) {
+		error = pidff_set_envelope_report(pidff, envelope);
+		if (error)
+			goto fail;
+	}
+
+	if (!IS_DEVICE_MANAGED(pidff)) {
+		if (!old || pidff->active.offset[0] !=
+			pidff->effect[effect->id].offset[0] ||
+			pidff->active.offset[1] !=
+			pidff->effect[effect->id].offset[1] ||
+			pidff->effect[effect->id].relocated ||
+			needs_set_effect) {
+
+			pidff->active.offset[0] =
+				pidff->effect[effect->id].offset[0];
+			pidff->active.offset[1] =
+				pidff->effect[effect->id].offset[1];
+			pidff_set_effect_report(pidff, effect);
+			pidff->effect[effect->id].relocated = 0;
+		}
+	}
+
+	info->image_ok = 1;
+loaded:
+	pidff->image_slot = -1;
+	spin_lock_irqsave(&pidff->lock, flags);
+	pidff->effect[effect->id].effect = *effect;
+	pidff->effect[effect->id].effect_type_id =
+		pidff->active.effect_type_id;
+	pidff->effect[effect->id].resident = 1;
+	spin_unlock_irqrestore(&pidff->lock, flags);
+
+	/* hid_dbg(pidff->hid, "uploaded\n"); */
+	pidff->active.id = -1;
+	pidff->active.offset[0]	= NULL;
+	pidff->active.offset[1] = NULL;
+	return 0;
+
+fail:
+	hid_dbg(pidff->hid, "upload failed\n");
+	pidff->image_slot = -1;
+	pidff_erase_pid(pidff, pidff->active.id);
+	pidff->active.id = -1;
+	pidff->active.offset[0]	= NULL;
+	pidff->active.offset[1] = NULL;
+	return error;
+}
+
+/*
+ * Load an effect into the device, either as a new effect or as an update of
+ * the resident effect old. The reports of the effect are queued back to back
+ * and sent in order from the output queue, nothing waits for them here.
+ */
+static int pidff_load_effect(struct pidff_device *pidff,
+			     struct ff_effect *effect, struct ff_effect *old)
+{
+	int error;
+
+	pidff_hold_reports(pidff);
+	error = __pidff_load_effect(pidff, effect, old);
+	pidff_release_reports(pidff);
+	return error;
+}
+
+/*
+ * Eviction priority of an effect, effects with a lower priority are evicted
+ * first. Conditions tend to stay in use for a whole session.
+ */
+static int pidff_effect_priority(struct pidff_info *info)
+{
+	switch (info->effect.type) {
+	case FF_SPRING:
+	case FF_FRICTION:
+	case FF_DAMPER:
+	case FF_INERTIA:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Evict the least recently used idle effect of the lowest priority from the
+ * device, keeping its copy on the host. Effect slot keep is never evicted,
+ * nor are effects started by the device on a trigger button.
+ */
+static int pidff_evict_effect(struct pidff_device *pidff, int keep)
+{
+	struct pidff_info *info, *victim = NULL;
+	unsigned long flags;
+	int slot;
+
+	spin_lock_irqsave(&pidff->lock, flags);
+	for (slot = 0; slot < pidff->nr_effects; slot++) {
+		info = &pidff->effect[slot];
+		if (slot == keep || !info->resident ||
+			info->effect.trigger.button ||
+			test_bit(slot, pidff->swap_pending) ||
+			pidff_effect_busy(pidff, slot))
+			continue;
+
+		if (!victim ||
+			pidff_effect_priority(info) <
+			pidff_effect_priority(victim) ||
+			(pidff_effect_priority(info) ==
+			pidff_effect_priority(victim) &&
+			time_before(info->last_used, victim->last_used)))
+			victim = info;
+	}
+	/* From now on playback of the victim waits for a swap in */
+	if (victim) {
+		victim->resident = 0;
+		/* Finished by its length but never stopped, stop it first */
+		if (!pidff_effect_stopped(pidff, victim - pidff->effect))
+			pidff_playback_pid(pidff, victim->id, 0);
+		victim->playing = 0;
+	}
+	spin_unlock_irqrestore(&pidff->lock, flags);
+
+	if (!victim)
+		return -ENOSPC;
+
+	hid_dbg(pidff->hid, "evicting effect %d\n",
+		(int)(victim - pidff->effect));
+	pidff_erase_pid(pidff, victim->id);
+
+	/* Held back and streamed updates become part of the host copy */
+	spin_lock_irqsave(&pidff->lock, flags);
+	if (victim->stream_dirty || victim->update_pending)
+		victim->image_ok = 0;
+	if (victim->stream_dirty)
+		victim->effect = victim->stream;
+	if (victim->update_pending)
+		victim->effect = victim->update;
+	victim->stream_dirty = 0;
+	spin_unlock_irqrestore(&pidff->lock, flags);
+	victim->update_pending = 0;
+	pidff->evictions++;
+	return 0;
+}
+
+/*
+ * Load a host side effect into the device, evicting other effects as needed
+ */
+static int pidff_swap_in(struct pidff_device *pidff, int slot)
+{
+	struct ff_effect effect = pidff->effect[slot].effect;
+	int error;
+
+	do {
+		error = pidff_load_effect(pidff, &effect, NULL);
+	} while (error == -ENOSPC && !pidff_evict_effect(pidff, slot));
+
+	if (!error)
+		pidff->swap_ins++;
+	return error;
+}
+
+static void pidff_erase_work(struct work_struct *work)
+{
+	struct pidff_device *pidff = container_of(to_delayed_work(work),
+		struct pidff_device, erase_work);
+
+	mutex_lock(&pidff->input->ff->mutex);
+	pidff_flush_erases(pidff);
+	mutex_unlock(&pidff->input->ff->mutex);
+}
+
+/*
+ * Load the effects uploaded asynchronously or played while not resident,
+ * and start the played ones
+ */
+static void pidff_swap_work(struct work_struct *work)
+{
+	struct pidff_device *pidff =
+		container_of(work, struct pidff_device, swap_work);
+	struct ff_device *ff = pidff->input->ff;
+	struct pidff_info *info;
+	unsigned long flags;
+	int slot, error;
+
+	mutex_lock(&ff->mutex);
+	pidff_flush_erases(pidff);
+	for_each_set_bit(slot, pidff->swap_pending, pidff->nr_effects) {
+		info = &pidff->effect[slot];
+		error = 0;
+		if (!info->resident && info->uploaded)
+			error = pidff_swap_in(pidff, slot);
+		pidff_release_slot(pidff, slot);
+		if (error)
+			hid_warn(pidff->hid, "failed to swap in effect %d: %d\n",
+				slot, error);
+
+		spin_lock_irqsave(&pidff->lock, flags);
+		if (test_and_clear_bit(slot, pidff->swap_pending) &&
+			info->resident && info->swap_count) {
+			info->playing = 1;
+			info->play_until = jiffies +
+				pidff_play_time(info, info->swap_count);
+			pidff_playback_pid(pidff, info->id, info->swap_count);
+		}
+		spin_unlock_irqrestore(&pidff->lock, flags);
+	}
+	mutex_unlock(&ff->mutex);
+}
+
+/*
+ * Test if output reports are still waiting in the driver or usbhid
+ */
+static int pidff_output_busy(struct pidff_device *pidff)
+{
+	struct usbhid_device *usbhid = pidff->hid->driver_data;
+	unsigned long flags;
+	int busy;
+
+	spin_lock_irqsave(&usbhid->lock, flags);
+	busy = usbhid->outhead != usbhid->outtail ||
+		usbhid->ctrlhead != usbhid->ctrltail;
+	spin_unlock_irqrestore(&usbhid->lock, flags);
+
+	spin_lock_irqsave(&pidff->sched_lock, flags);
+	busy |= pidff->sched_head != pidff->sched_tail;
+	spin_unlock_irqrestore(&pidff->sched_lock, flags);
+
+	return busy;
+}
+
+/*
+ * Send the latest held back effect updates once the output queue is empty
+ */
+static void pidff_update_work(struct work_struct *work)
+{
+	struct pidff_device *pidff = container_of(to_delayed_work(work),
+		struct pidff_device, update_work);
+	struct ff_device *ff = pidff->input->ff;
+	struct pidff_info *info;
+	struct ff_effect effect, old;
+	unsigned long flags;
+	int slot, error;
+
+	mutex_lock(&ff->mutex);
+	pidff_flush_erases(pidff);
+	if (pidff_output_busy(pidff)) {
+		pidff_queue_delayed(pidff, &pidff->update_work, 1);
+		goto out;
+	}
+
+	for (slot = 0; slot < pidff->nr_effects; slot++) {
+		info = &pidff->effect[slot];
+
+		/* Streamed values the stream timer could not send */
+		spin_lock_irqsave(&pidff->lock, flags);
+		if (info->stream_dirty && !info->update_pending) {
+			info->update = info->stream;
+			info->update_pending = 1;
+		}
+		info->stream_dirty = 0;
+		old = info->effect;
+		spin_unlock_irqrestore(&pidff->lock, flags);
+
+		if (!info->update_pending)
+			continue;
+
+		info->update_pending = 0;
+		effect = info->update;
+		error = pidff_load_effect(pidff, &effect, &old);
+		if (error) {
+			hid_warn(pidff->hid, "failed to update effect %d: %d\n",
+				slot, error);
+			/* Swapped in again when played */
+			spin_lock_irqsave(&pidff->lock, flags);
+			info->effect = effect;
+			info->image_ok = 0;
+			spin_unlock_irqrestore(&pidff->lock, flags);
+		}
+	}
+out:
+	mutex_unlock(&ff->mutex);
+}
+
+/*
+ * Check that the device can play an effect without loading it
+ */
+static int pidff_check_effect(struct pidff_device *pidff,
+			      struct ff_effect *effect)
+{
+	if (!test_bit(effect->type, pidff->input->ffbit))
+		return -EINVAL;
+
+	if (effect->type == FF_PERIODIC &&
+		!test_bit(effect->u.periodic.waveform, pidff->input->ffbit))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Test if an update of a resident effect only changes the constant level or
+ * the periodic magnitude and offset, which can be sent with a single report
+ */
+static int pidff_streamable(struct pidff_device *pidff,
+			    struct pidff_info *info, struct ff_effect *effect)
+{
+	struct pidff_memory_block *block = info->offset[0];
+	struct ff_effect compare = *effect;
+
+	switch (effect->type) {
+	case FF_CONSTANT:
+		compare.u.constant.level = info->effect.u.constant.level;
+		break;
+	case FF_PERIODIC:
+		compare.u.periodic.magnitude =
+			info->effect.u.periodic.magnitude;
+		compare.u.periodic.offset = info->effect.u.periodic.offset;
 		break;
-
 	default:
-		hid_err(pidff->hid, "invalid type\n");
-		return -EINVAL;
+		return 0;
 	}
 
-	if (!old) {
-		error = pidff_request_effect_upload(pidff,
-			pidff->type_id[type_id]);
-		if (error)
-			return error;
-	}
+	if (memcmp(&compare, &info->effect, sizeof(compare)))
+		return 0;
 
-	if (needs_set_effect && IS_DEVICE_MANAGED(pidff))
-		pidff_set_effect_report(pidff, effect);
+	/* A shared block needs copy on write, leave it to upload */
+	return IS_DEVICE_MANAGED(pidff) || (block && block->refcount == 1);
+}
 
-	if ((!old || (needs_set_report && (*needs_set_report)(effect, old))) &&
-		set_report_func) {
-		error = (*set_report_func)(pidff, effect);
-		if (error)
-			goto fail;
+/*
+ * Send the constant or periodic report of a streamable update straight to
+ * the block the effect already owns
+ */
+static void pidff_send_stream(struct pidff_device *pidff,
+			      struct pidff_info *info, struct ff_effect *effect)
+{
+	struct pidff_memory_block *block = info->offset[0];
+	struct pidff_usage *usage;
+	int report, count, key, i;
+
+	if (effect->type == FF_CONSTANT) {
+		report = PID_SET_CONSTANT;
+		usage = pidff->set_constant;
+		pidff_set_signed(&usage[PID_MAGNITUDE],
+			effect->u.constant.level);
+	} else {
+		report = PID_SET_PERIODIC;
+		usage = pidff->set_periodic;
+		pidff_set_signed(&usage[PID_MAGNITUDE],
+			effect->u.periodic.magnitude);
+		pidff_set_signed(&usage[PID_OFFSET],
+			effect->u.periodic.offset);
+		pidff_set(&usage[PID_PHASE], effect->u.periodic.phase);
+		usage[PID_PERIOD].value[0] = effect->u.periodic.period;
 	}
 
-	if (envelope &&	(!old ||
-		pidff_needs_set_envelope(envelope, old_envelope))) {
-		error = pidff_set_envelope_report(pidff, envelope);
-		if (error)
-			goto fail;
+	if (IS_DEVICE_MANAGED(pidff)) {
+		usage[PID_EFFECT_BLOCK_INDEX].value[0] = info->id;
+		key = info->id * PID_AXES_MAX;
+	} else {
+		usage[PID_PARAM_BLOCK_OFFSET].value[0] = block->block_offset;
+		key = block - pidff->blocks;
+
+		if (hash_hashed(&block->hash_node)) {
+			pidff_param_usage(pidff, report, &count);
+			hash_del(&block->hash_node);
+			for (i = 1; i < count; i++)
+				block->payload[i - 1] = usage[i].value[0];
+			block->hash = jhash2((u32 *)block->payload,
+				PID_PAYLOAD_MAX, report);
+			hash_add(pidff->shared_blocks, &block->hash_node,
+				block->hash);
+		}
 	}
 
-	if (!IS_DEVICE_MANAGED(pidff)) {
-		if (!old || pidff->active.offset[0] !=
-			pidff->effect[effect->id].offset[0] ||
-			pidff->active.offset[1] !=
-			pidff->effect[effect->id].offset[1] ||
-			needs_set_effect) {
+	pidff_save_image(pidff, info - pidff->effect, 1, report);
+	pidff_send_report(pidff, report, key, info->id);
+	pidff->fast_updates++;
+}
 
-			pidff->active.offset[0] =
-				pidff->effect[effect->id].offset[0];
-			pidff->active.offset[1] =
-				pidff->effect[effect->id].offset[1];
-			pidff_set_effect_report(pidff, effect);
+/*
+ * Stream timer, sends the latest streamed values once per polling interval
+ * of the output endpoint. The timer stops after an interval with nothing
+ * to send.
+ */
+static enum hrtimer_restart pidff_stream_timer(struct hrtimer *timer)
+{
+	struct pidff_device *pidff =
+		container_of(timer, struct pidff_device, stream_timer);
+	struct pidff_info *info;
+	s64 jitter;
+	int slot, sent = 0;
+
+	jitter = ktime_to_ns(ktime_sub(ktime_get(),
+		hrtimer_get_expires(timer)));
+
+	spin_lock(&pidff->lock);
+	pidff->stream_frames++;
+	pidff->stream_jitter_sum += jitter;
+	if (jitter > pidff->stream_jitter_max)
+		pidff->stream_jitter_max = jitter;
+
+	/* Reports are being built in process context, try again next frame */
+	if (pidff->report_hold) {
+		pidff->stream_skipped++;
+		sent = 1;
+		goto out;
+	}
+
+	for (slot = 0; slot < pidff->nr_effects; slot++) {
+		info = &pidff->effect[slot];
+		if (!info->stream_dirty)
+			continue;
+
+		if (!info->resident || !pidff_streamable(pidff, info,
+			&info->stream)) {
+			/* Block became shared, leave it to the update work */
+			pidff_queue_delayed(pidff, &pidff->update_work, 0);
+			continue;
 		}
+
+		pidff_send_stream(pidff, info, &info->stream);
+		info->effect = info->stream;
+		info->stream_dirty = 0;
+		sent = 1;
 	}
+out:
+	spin_unlock(&pidff->lock);
 
-	/* hid_dbg(pidff->hid, "uploaded\n"); */
-	pidff->active.id = -1;
-	pidff->active.offset[0]	= NULL;
-	pidff->active.offset[1] = NULL;
-	return 0;
+	if (!sent)
+		return HRTIMER_NORESTART;
 
-fail:
-	hid_dbg(pidff->hid, "upload failed\n");
-	pidff_erase_pid(pidff, pidff->active.id);
-	pidff->active.id = -1;
-	pidff->active.offset[0]	= NULL;
-	pidff->active.offset[1] = NULL;
-	return error;
+	hrtimer_forward_now(timer, pidff->stream_period);
+	return HRTIMER_RESTART;
 }
 
 /*
- * set_gain() handler
+ * Effect upload handler
  */
-static void pidff_set_gain(struct input_dev *dev, u16 gain)
+static int pidff_upload_effect(struct input_dev *dev, struct ff_effect *effect,
+			       struct ff_effect *old)
 {
 	struct pidff_device *pidff = dev->ff->private;
+	struct pidff_info *info = &pidff->effect[effect->id];
+	struct ff_effect resident_effect;
+	unsigned long flags;
+	int error, lazy, streamable;
 
-	pidff_set(&pidff->device_gain[PID_DEVICE_GAIN_FIELD], gain);
-	hid_hw_request(pidff->hid, pidff->reports[PID_DEVICE_GAIN],
-			HID_REQ_SET_REPORT);
-}
+	if (pidff->dead)
+		return -ENODEV;
 
-static void pidff_autocenter(struct pidff_device *pidff, u16 magnitude)
-{
-	struct hid_field *field;
+	/* An evicted effect is loaded from scratch, a resident one is
+	 * compared to what the device holds. The stream timer changes that,
+	 * so it is read under the lock.
+	 */
+	spin_lock_irqsave(&pidff->lock, flags);
+	old = NULL;
+	if (info->resident) {
+		resident_effect = info->effect;
+		old = &resident_effect;
+	}
 
-	if (IS_DEVICE_MANAGED(pidff)) {
-		field = pidff->block_load[PID_EFFECT_BLOCK_INDEX].field;
+	streamable = old && pidff_stream && !info->update_pending &&
+		pidff_streamable(pidff, info, effect);
+	if (streamable) {
+		/* Sent by the stream timer */
+		info->stream = *effect;
+		info->stream_dirty = 1;
+		if (!pidff->dead && !hrtimer_is_queued(&pidff->stream_timer))
+			hrtimer_start(&pidff->stream_timer,
+				pidff->stream_period, HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&pidff->lock, flags);
+	if (streamable) {
+		info->last_used = jiffies;
+		return 0;
+	}
 
-		if (!magnitude) {
-			pidff_playback_pid(pidff, field->logical_minimum, 0);
-			return;
+	if (old && pidff_coalesce &&
+		(info->update_pending || pidff_output_busy(pidff))) {
+		/* Latest update wins, sent when the output queue is empty */
+		if (info->update_pending)
+			pidff->coalesced_updates++;
+		else
+			pidff->deferred_updates++;
+		info->update = *effect;
+		info->update_pending = 1;
+		info->last_used = jiffies;
+		pidff_queue_delayed(pidff, &pidff->update_work, 1);
+		return 0;
+	}
+
+	if (old && !info->update_pending) {
+		spin_lock_irqsave(&pidff->lock, flags);
+		streamable = pidff_streamable(pidff, info, effect);
+		if (streamable) {
+			pidff_send_stream(pidff, info, effect);
+			info->effect = *effect;
+		}
+		spin_unlock_irqrestore(&pidff->lock, flags);
+		if (streamable) {
+			info->last_used = jiffies;
+			return 0;
 		}
+	}
 
-		pidff_playback_pid(pidff, field->logical_minimum, 1);
+	/* A full upload includes any streamed values */
+	spin_lock_irqsave(&pidff->lock, flags);
+	info->stream_dirty = 0;
+	spin_unlock_irqrestore(&pidff->lock, flags);
+
+	/* Effects started on a trigger button are never played by the host */
+	lazy = pidff_lazy_upload && !effect->trigger.button;
+	if (!old && (lazy || pidff_async)) {
+		/* Loaded by the swap work, right away or when first played */
+		error = pidff_check_effect(pidff, effect);
+		if (!error && !lazy)
+			error = pidff_reserve_slot(pidff, effect->id);
+		if (error)
+			return error;
 
-		pidff->set_effect[PID_EFFECT_BLOCK_INDEX].value[0] =
-			pidff->block_load[PID_EFFECT_BLOCK_INDEX].field->
-			logical_minimum;
+		spin_lock_irqsave(&pidff->lock, flags);
+		info->effect = *effect;
+		info->image_ok = 0;
+		if (!lazy) {
+			info->swap_count = 0;
+			set_bit(effect->id, pidff->swap_pending);
+			pidff_queue_work(pidff, &pidff->swap_work);
+		}
+		spin_unlock_irqrestore(&pidff->lock, flags);
+		info->uploaded = 1;
+		info->last_used = jiffies;
+		if (lazy)
+			pidff->deferred_uploads++;
+		else
+			pidff->async_uploads++;
+		return 0;
+	}
 
-		pidff->set_effect_type->value[0] = pidff->type_id[PID_SPRING];
+	if (old && pidff_async) {
+		/* Sent by the update work */
+		info->update = *effect;
+		info->update_pending = 1;
+		info->last_used = jiffies;
+		pidff_queue_delayed(pidff, &pidff->update_work, 0);
+		pidff->async_uploads++;
+		return 0;
+	}
 
-		pidff->set_effect[PID_DURATION].value[0] = 0;
-		pidff->set_effect[PID_TRIGGER_BUTTON].value[0] = 0;
-		pidff->set_effect[PID_TRIGGER_REPEAT_INT].value[0] = 0;
-		pidff_set(&pidff->set_effect_optional[PID_GAIN], magnitude);
-		pidff->set_effect[PID_DIRECTION_ENABLE].value[0] = 1;
-		pidff->set_effect[PID_START_DELAY].value[0] = 0;
+	error = pidff_load_effect(pidff, effect, old);
+	if (error == -ENOSPC && effect->trigger.button) {
+		/* Started by the device itself, it has to be resident */
+		while (error == -ENOSPC &&
+			!pidff_evict_effect(pidff, effect->id))
+			error = pidff_load_effect(pidff, effect, old);
+	} else if (error == -ENOSPC && pidff->nr_effects > pidff->max_effects) {
+		/* Device is full, keep the effect on the host until played */
+		hid_dbg(pidff->hid, "effect %d kept on the host\n", effect->id);
+		spin_lock_irqsave(&pidff->lock, flags);
+		info->effect = *effect;
+		info->image_ok = 0;
+		spin_unlock_irqrestore(&pidff->lock, flags);
+		error = 0;
+	}
 
-		hid_hw_request(pidff->hid, pidff->reports[PID_SET_EFFECT],
-			HID_REQ_SET_REPORT);
+	if (!error) {
+		info->uploaded = 1;
+		info->last_used = jiffies;
 	}
+	return error;
+}
+
+/*
+ * set_gain() handler
+ */
+static void pidff_set_gain(struct input_dev *dev, u16 gain)
+{
+	struct pidff_device *pidff = dev->ff->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pidff->lock, flags);
+	pidff_set(&pidff->device_gain[PID_DEVICE_GAIN_FIELD], gain);
+	pidff_send_report(pidff, PID_DEVICE_GAIN, 0, -1);
+	spin_unlock_irqrestore(&pidff->lock, flags);
 }
 
 /*
@@ -1381,6 +4031,8 @@ static int pidff_find_fields(struct pidff_usage *usage, const u8 *table,
 					usage[k].field = report->field[i];
 					usage[k].value =
 						&report->field[i]->value[j];
+					pidff_init_scale(usage[k].scale,
+						report->field[i]);
 					found = 1;
 					break;
 				}
@@ -1496,7 +4148,7 @@ static int pidff_reports_ok(struct pidff_device *pidff)
 	}
 
 	/* Check for reports required for pool move (garbage collect) */
-	for (i = PID_REQUIRED_DEVICE_MANAGED; i <= PID_REQUIRED_POOL_MOVE;
+	for (i = PID_REQUIRED_DEVICE_MANAGED + 1; i <= PID_REQUIRED_POOL_MOVE;
 						i++) {
 		if (!pidff->reports[i]) {
 			hid_dbg(pidff->hid, "%d missing for pool moving\n", i);
@@ -1611,6 +4263,7 @@ static int pidff_find_special_fields(struct pidff_device *pidff)
 		hid_err(pidff->hid, "direction field not found\n");
 		return -1;
 	}
+	pidff_init_scale(pidff->direction_scale, pidff->effect_direction);
 
 	if (!pidff->axes_enable) {
 		hid_err(pidff->hid, "axes enable field not found\n");
@@ -1817,27 +4470,362 @@ static int pidff_init_fields(struct pidff_device *pidff, struct input_dev *dev)
 	if (!PIDFF_FIND_FIELDS(device_gain, PID_DEVICE_GAIN, 1, pidff))
 		set_bit(FF_GAIN, dev->ffbit);
 
-	if (IS_DEVICE_MANAGED(pidff)) {
-		PIDFF_FIND_FIELDS(block_load, PID_BLOCK_LOAD, 0, pidff);
-		if (!pidff->block_load[PID_EFFECT_BLOCK_INDEX].value) {
-			hid_err(pidff->hid, "unknown pid_block_load report layout\n");
-			return -ENODEV;
-		}
+	if (IS_DEVICE_MANAGED(pidff)) {
+		PIDFF_FIND_FIELDS(block_load, PID_BLOCK_LOAD, 0, pidff);
+		if (!pidff->block_load[PID_EFFECT_BLOCK_INDEX].value) {
+			hid_err(pidff->hid, "unknown pid_block_load report layout\n");
+			return -ENODEV;
+		}
+
+		if (PIDFF_FIND_FIELDS(block_free, PID_BLOCK_FREE, 1, pidff)) {
+			hid_err(pidff->hid, "unknown pid_block_free report layout\n");
+			return -ENODEV;
+		}
+	}
+
+	if (test_bit(PID_SUPPORTS_POOL_MOVE, &pidff->flags)) {
+		if (PIDFF_FIND_FIELDS(pool_move, PID_POOL_MOVE, 1, pidff)) {
+			hid_warn(pidff->hid, "unknown pid_pool_move report layout\n");
+			clear_bit(PID_SUPPORTS_POOL_MOVE, &pidff->flags);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Report layouts found before, by report descriptor. Devices of a known
+ * model get their reports and fields without searching for them. The
+ * layouts are kept while any device is bound.
+ */
+#define PID_LAYOUT_CACHE_MAX	8
+
+struct pidff_usage_table {
+	size_t offset;			/* Of the pidff_usage array */
+	u8 count;
+	u8 report;
+};
+
+#define PIDFF_USAGE_TABLE(name, report) \
+	{ offsetof(struct pidff_device, name), \
+	  ARRAY_SIZE(((struct pidff_device *)NULL)->name), report }
+
+static const struct pidff_usage_table pidff_usage_tables[] = {
+	PIDFF_USAGE_TABLE(set_effect, PID_SET_EFFECT),
+	PIDFF_USAGE_TABLE(set_effect_optional, PID_SET_EFFECT),
+	PIDFF_USAGE_TABLE(block_offset, PID_SET_EFFECT),
+	PIDFF_USAGE_TABLE(set_envelope, PID_SET_ENVELOPE),
+	PIDFF_USAGE_TABLE(set_condition, PID_SET_CONDITION),
+	PIDFF_USAGE_TABLE(set_periodic, PID_SET_PERIODIC),
+	PIDFF_USAGE_TABLE(set_constant, PID_SET_CONSTANT),
+	PIDFF_USAGE_TABLE(set_ramp, PID_SET_RAMP),
+	PIDFF_USAGE_TABLE(device_gain, PID_DEVICE_GAIN),
+	PIDFF_USAGE_TABLE(block_load, PID_BLOCK_LOAD),
+	PIDFF_USAGE_TABLE(pool, PID_POOL),
+	PIDFF_USAGE_TABLE(pool_move, PID_POOL_MOVE),
+	PIDFF_USAGE_TABLE(effect_operation, PID_EFFECT_OPERATION),
+	PIDFF_USAGE_TABLE(block_free, PID_BLOCK_FREE),
+};
+
+#define PID_LAYOUT_USAGES (sizeof(pidff_set_effect) + \
+	sizeof(pidff_set_effect_optional) + PID_AXES_MAX + \
+	sizeof(pidff_set_envelope) + sizeof(pidff_set_condition) + \
+	sizeof(pidff_set_periodic) + sizeof(pidff_set_constant) + \
+	sizeof(pidff_set_ramp) + sizeof(pidff_device_gain) + \
+	sizeof(pidff_block_load) + sizeof(pidff_pool) + \
+	sizeof(pidff_pool_move) + sizeof(pidff_effect_operation) + \
+	sizeof(pidff_block_free))
+
+#define PIDFF_SPECIAL_TABLE(name, report) \
+	{ offsetof(struct pidff_device, name), 1, report }
+
+static const struct pidff_usage_table pidff_special_tables[] = {
+	PIDFF_SPECIAL_TABLE(create_new_effect_type, PID_CREATE_NEW_EFFECT),
+	PIDFF_SPECIAL_TABLE(set_effect_type, PID_SET_EFFECT),
+	PIDFF_SPECIAL_TABLE(effect_direction, PID_SET_EFFECT),
+	PIDFF_SPECIAL_TABLE(axes_enable, PID_SET_EFFECT),
+	PIDFF_SPECIAL_TABLE(device_control, PID_DEVICE_CONTROL),
+	PIDFF_SPECIAL_TABLE(block_load_status, PID_BLOCK_LOAD),
+	PIDFF_SPECIAL_TABLE(effect_operation_status, PID_EFFECT_OPERATION),
+};
+
+/* Position of a field, and of a value within it. -1 if not found. */
+struct pidff_layout_usage {
+	s16 field;
+	s16 index;
+};
+
+struct pidff_layout {
+	struct list_head list;
+	u32 hash;
+	unsigned int rsize;
+
+	s8 report_type[sizeof(pidff_reports)];	/* -1 if not found */
+	u8 report_id[sizeof(pidff_reports)];
+	struct pidff_layout_usage usage[PID_LAYOUT_USAGES];
+	struct pidff_layout_usage special[ARRAY_SIZE(pidff_special_tables)];
+
+	int control_id[sizeof(pidff_device_control)];
+	int type_id[sizeof(pidff_effect_types)];
+	int status_id[sizeof(pidff_block_load_status)];
+	int operation_id[sizeof(pidff_effect_operation_status)];
+	unsigned long ffbit[BITS_TO_LONGS(FF_CNT)];
+	unsigned long flags;
+	s8 autocenter;			/* Autocenter probe result, -1 if none */
+};
+
+static LIST_HEAD(pidff_layouts);
+static DEFINE_MUTEX(pidff_layouts_lock);
+static unsigned int pidff_layout_hits, pidff_layout_misses;
+
+/*
+ * Position of field in report, -1 if it is not there
+ */
+static int pidff_field_index(struct hid_report *report,
+			     struct hid_field *field)
+{
+	int i;
+
+	for (i = 0; report && field && i < report->maxfield; i++)
+		if (report->field[i] == field)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Field at position pos of report, NULL if there is none
+ */
+static struct hid_field *pidff_layout_field(struct hid_report *report,
+					    struct pidff_layout_usage *pos)
+{
+	if (!report || pos->field < 0 || pos->field >= report->maxfield)
+		return NULL;
+
+	if (pos->index >= (int)report->field[pos->field]->report_count)
+		return NULL;
+
+	return report->field[pos->field];
+}
+
+/*
+ * Remember the layout found for the report descriptor of the device
+ */
+static void pidff_layout_save(struct pidff_device *pidff,
+			      struct input_dev *dev)
+{
+	struct hid_device *hid = pidff->hid;
+	const struct pidff_usage_table *table;
+	struct pidff_layout *layout, *old;
+	struct pidff_usage *usage;
+	struct hid_report *report;
+	struct hid_field *field;
+	int i, k, n = 0;
+
+	layout = kzalloc(sizeof(*layout), GFP_KERNEL);
+	if (!layout)
+		return;
+
+	layout->hash = jhash(hid->rdesc, hid->rsize, 0);
+	layout->rsize = hid->rsize;
+	layout->autocenter = -1;
+
+	for (i = 0; i < sizeof(pidff_reports); i++) {
+		report = pidff->reports[i];
+		layout->report_type[i] = report ? report->type : -1;
+		layout->report_id[i] = report ? report->id : 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pidff_usage_tables); i++) {
+		table = &pidff_usage_tables[i];
+		usage = (void *)pidff + table->offset;
+		report = pidff->reports[table->report];
+		for (k = 0; k < table->count; k++, n++) {
+			layout->usage[n].field =
+				pidff_field_index(report, usage[k].field);
+			layout->usage[n].index = usage[k].field ?
+				usage[k].value - usage[k].field->value : -1;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pidff_special_tables); i++) {
+		table = &pidff_special_tables[i];
+		field = *(struct hid_field **)((void *)pidff + table->offset);
+		layout->special[i].field = pidff_field_index(
+			pidff->reports[table->report], field);
+		layout->special[i].index = 0;
+	}
+
+	memcpy(layout->control_id, pidff->control_id,
+		sizeof(layout->control_id));
+	memcpy(layout->type_id, pidff->type_id, sizeof(layout->type_id));
+	memcpy(layout->status_id, pidff->status_id, sizeof(layout->status_id));
+	memcpy(layout->operation_id, pidff->operation_id,
+		sizeof(layout->operation_id));
+	memcpy(layout->ffbit, dev->ffbit, sizeof(layout->ffbit));
+	layout->flags = pidff->flags;
+
+	n = 0;
+	mutex_lock(&pidff_layouts_lock);
+	list_for_each_entry(old, &pidff_layouts, list) {
+		if (old->hash == layout->hash && old->rsize == layout->rsize) {
+			/* Another device of the model got here first */
+			mutex_unlock(&pidff_layouts_lock);
+			kfree(layout);
+			return;
+		}
+		n++;
+	}
+	list_add(&layout->list, &pidff_layouts);
+	if (n >= PID_LAYOUT_CACHE_MAX) {
+		/* Drop the least recently used layout */
+		old = list_last_entry(&pidff_layouts, struct pidff_layout,
+			list);
+		list_del(&old->list);
+		kfree(old);
+	}
+	mutex_unlock(&pidff_layouts_lock);
+}
+
+/*
+ * Check that layout fits the reports of the device, and take it over if
+ * apply is set
+ */
+static int pidff_layout_apply(struct pidff_device *pidff,
+			      struct input_dev *dev,
+			      struct pidff_layout *layout, int apply)
+{
+	struct hid_device *hid = pidff->hid;
+	const struct pidff_usage_table *table;
+	struct hid_report *reports[sizeof(pidff_reports)];
+	struct pidff_layout_usage *pos;
+	struct pidff_usage *usage;
+	struct hid_field *field;
+	int i, k, n = 0;
+
+	for (i = 0; i < sizeof(pidff_reports); i++) {
+		reports[i] = NULL;
+		if (layout->report_type[i] < 0)
+			continue;
+		reports[i] = hid->report_enum[layout->report_type[i]].
+			report_id_hash[layout->report_id[i]];
+		if (!reports[i])
+			return -ENOENT;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pidff_usage_tables); i++) {
+		table = &pidff_usage_tables[i];
+		usage = (void *)pidff + table->offset;
+		for (k = 0; k < table->count; k++, n++) {
+			pos = &layout->usage[n];
+			field = pidff_layout_field(reports[table->report], pos);
+			if (!field && pos->field >= 0)
+				return -ENOENT;
+			if (!apply || !field)
+				continue;
+
+			usage[k].field = field;
+			usage[k].value = &field->value[pos->index];
+			pidff_init_scale(usage[k].scale, field);
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pidff_special_tables); i++) {
+		table = &pidff_special_tables[i];
+		pos = &layout->special[i];
+		field = pidff_layout_field(reports[table->report], pos);
+		if (!field && pos->field >= 0)
+			return -ENOENT;
+		if (apply)
+			*(struct hid_field **)((void *)pidff + table->offset) =
+				field;
+	}
+
+	if (!apply)
+		return 0;
+
+	memcpy(pidff->reports, reports, sizeof(pidff->reports));
+	memcpy(pidff->control_id, layout->control_id,
+		sizeof(pidff->control_id));
+	memcpy(pidff->type_id, layout->type_id, sizeof(pidff->type_id));
+	memcpy(pidff->status_id, layout->status_id, sizeof(pidff->status_id));
+	memcpy(pidff->operation_id, layout->operation_id,
+		sizeof(pidff->operation_id));
+	bitmap_or(dev->ffbit, dev->ffbit, layout->ffbit, FF_CNT);
+	pidff->flags = layout->flags;
+	pidff->layout_autocenter = layout->autocenter;
+	pidff_init_scale(pidff->direction_scale, pidff->effect_direction);
+
+	return 0;
+}
+
+/*
+ * Take the layout of the device from the cache. Returns 0 if it was there.
+ */
+static int pidff_layout_load(struct pidff_device *pidff,
+			     struct input_dev *dev)
+{
+	struct hid_device *hid = pidff->hid;
+	struct pidff_layout *layout;
+	u32 hash = jhash(hid->rdesc, hid->rsize, 0);
+	int error = -ENOENT;
+
+	mutex_lock(&pidff_layouts_lock);
+	list_for_each_entry(layout, &pidff_layouts, list) {
+		if (layout->hash != hash || layout->rsize != hid->rsize)
+			continue;
+
+		error = pidff_layout_apply(pidff, dev, layout, 0);
+		if (!error)
+			error = pidff_layout_apply(pidff, dev, layout, 1);
+		if (!error)
+			list_move(&layout->list, &pidff_layouts);
+		break;
+	}
+
+	if (error)
+		pidff_layout_misses++;
+	else
+		pidff_layout_hits++;
+	mutex_unlock(&pidff_layouts_lock);
+
+	hid_dbg(hid, "report layout %s\n", error ? "not cached" : "cached");
+	return error;
+}
+
+/*
+ * Remember the result of the autocenter probe in the cached layout
+ */
+static void pidff_layout_autocenter(struct pidff_device *pidff, int supported)
+{
+	struct hid_device *hid = pidff->hid;
+	struct pidff_layout *layout;
+	u32 hash = jhash(hid->rdesc, hid->rsize, 0);
 
-		if (PIDFF_FIND_FIELDS(block_free, PID_BLOCK_FREE, 1, pidff)) {
-			hid_err(pidff->hid, "unknown pid_block_free report layout\n");
-			return -ENODEV;
+	mutex_lock(&pidff_layouts_lock);
+	list_for_each_entry(layout, &pidff_layouts, list) {
+		if (layout->hash == hash && layout->rsize == hid->rsize) {
+			layout->autocenter = supported;
+			break;
 		}
 	}
+	mutex_unlock(&pidff_layouts_lock);
+}
 
-	if (test_bit(PID_SUPPORTS_POOL_MOVE, &pidff->flags)) {
-		if (PIDFF_FIND_FIELDS(pool_move, PID_POOL_MOVE, 0, pidff)) {
-			hid_err(pidff->hid, "unknown pid_pool_move report layout\n");
-			return -ENODEV;
-		}
-	}
+/*
+ * Free the cached report layouts. For usbhid to call when the module goes
+ * away, the layouts outlive the devices so that a replug finds them.
+ */
+void hid_pidff_exit(void)
+{
+	struct pidff_layout *layout, *next;
 
-	return 0;
+	mutex_lock(&pidff_layouts_lock);
+	list_for_each_entry_safe(layout, next, &pidff_layouts, list) {
+		list_del(&layout->list);
+		kfree(layout);
+	}
+	mutex_unlock(&pidff_layouts_lock);
 }
 
 /*
@@ -1848,6 +4836,9 @@ static void pidff_reset(struct pidff_device *pidff)
 	struct hid_device *hid = pidff->hid;
 
 	pidff_empty_memory(pidff);
+	pidff_shadow_reset(pidff);
+	/* The device frees everything itself */
+	bitmap_zero(pidff->erase_pending, PID_EFFECTS_MAX + 1);
 
 	pidff->device_control->value[0] = pidff->control_id[PID_RESET];
 	/* We reset twice as sometimes hid_wait_io isn't waiting long enough */
@@ -1862,6 +4853,182 @@ static void pidff_reset(struct pidff_device *pidff)
 	hid_hw_wait(hid);
 }
 
+/*
+ * Forget all effects the device held, they stay uploaded on the host
+ */
+static void pidff_forget_device(struct pidff_device *pidff)
+{
+	struct pidff_info *info;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&pidff->lock, flags);
+
+	/* Waiting reports were meant for the effects that are gone */
+	spin_lock(&pidff->sched_lock);
+	pidff->sched_tail = pidff->sched_head;
+	memset(pidff->sched_pid, 0, sizeof(pidff->sched_pid));
+	spin_unlock(&pidff->sched_lock);
+
+	for (i = 0; i < pidff->nr_effects; i++) {
+		info = &pidff->effect[i];
+		info->id = -1;
+		info->offset[0] = NULL;
+		info->offset[1] = NULL;
+		info->relocated = 0;
+		info->reload = 0;
+		info->resident = 0;
+	}
+	for (i = 0; i <= PID_EFFECTS_MAX; i++)
+		pidff->pid_slot[i] = -1;
+	bitmap_zero(pidff->pid_used, PID_EFFECTS_MAX);
+	/* Ids held for async uploads stay held */
+	for (i = 0; i < pidff->nr_effects; i++) {
+		info = &pidff->effect[i];
+		if (info->reserved && info->reserved_id >= 0)
+			set_bit(info->reserved_id, pidff->pid_used);
+	}
+
+	spin_unlock_irqrestore(&pidff->lock, flags);
+}
+
+/*
+ * Order in which effects are restored: playing effects, then conditions,
+ * then the others
+ */
+static int pidff_restore_order(struct pidff_info *info, int busy)
+{
+	if (busy)
+		return 0;
+
+	return pidff_effect_priority(info) ? 1 : 2;
+}
+
+/*
+ * Start a restored effect again for what was left of its playback
+ */
+static void pidff_restart_effect(struct pidff_device *pidff, int slot)
+{
+	struct pidff_info *info = &pidff->effect[slot];
+	unsigned int period, count = 1;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pidff->lock, flags);
+	period = info->effect.replay.delay + info->effect.replay.length;
+	if (info->effect.replay.length && period &&
+	    time_before(jiffies, info->play_until))
+		count = DIV_ROUND_UP(jiffies_to_msecs(info->play_until -
+			jiffies), period);
+
+	if (info->resident) {
+		pidff_playback_pid(pidff, info->id, count);
+	} else {
+		/* Did not fit, the swap work makes room for it */
+		info->swap_count = count;
+		set_bit(slot, pidff->swap_pending);
+		pidff_queue_work(pidff, &pidff->swap_work);
+	}
+	spin_unlock_irqrestore(&pidff->lock, flags);
+}
+
+/*
+ * Reset the device and load the effects it held again in one go, restarting
+ * the playing ones first. For when the device lost its state, e.g. after a
+ * USB reset or a resume without power.
+ */
+static void pidff_restore(struct pidff_device *pidff)
+{
+	struct ff_device *ff = pidff->input->ff;
+	DECLARE_BITMAP(resident, FF_MAX_EFFECTS);
+	DECLARE_BITMAP(busy, FF_MAX_EFFECTS);
+	struct pidff_info *info;
+	struct ff_effect effect;
+	unsigned long flags;
+	ktime_t start;
+	int pass, slot, error, restarted = 0;
+	s64 us;
+
+	mutex_lock(&ff->mutex);
+	if (pidff->dead) {
+		mutex_unlock(&ff->mutex);
+		return;
+	}
+	pidff_hold_reports(pidff);
+	start = ktime_get();
+
+	bitmap_zero(resident, FF_MAX_EFFECTS);
+	bitmap_zero(busy, FF_MAX_EFFECTS);
+	spin_lock_irqsave(&pidff->lock, flags);
+	for (slot = 0; slot < pidff->nr_effects; slot++) {
+		if (!pidff->effect[slot].resident)
+			continue;
+		set_bit(slot, resident);
+		if (pidff_effect_busy(pidff, slot))
+			set_bit(slot, busy);
+	}
+	spin_unlock_irqrestore(&pidff->lock, flags);
+
+	pidff_forget_device(pidff);
+	pidff_reset(pidff);
+
+	if (test_bit(FF_GAIN, pidff->input->ffbit)) {
+		spin_lock_irqsave(&pidff->lock, flags);
+		pidff_send_report(pidff, PID_DEVICE_GAIN, 0, -1);
+		spin_unlock_irqrestore(&pidff->lock, flags);
+	}
+	if (test_bit(FF_AUTOCENTER, pidff->input->ffbit))
+		pidff_autocenter(pidff, pidff->autocenter);
+
+	for (pass = 0; pass < 3; pass++) {
+		for (slot = 0; slot < pidff->nr_effects; slot++) {
+			info = &pidff->effect[slot];
+			if (!test_bit(slot, resident) ||
+			    pidff_restore_order(info, test_bit(slot, busy)) !=
+			    pass)
+				continue;
+
+			/* Sent from its images where possible */
+			effect = info->effect;
+			error = pidff_load_effect(pidff, &effect, NULL);
+			if (error) {
+				hid_warn(pidff->hid,
+					"failed to restore effect %d: %d\n",
+					slot, error);
+				pidff->restore_failures++;
+			} else {
+				pidff->restored++;
+			}
+
+			if (test_bit(slot, busy)) {
+				pidff_restart_effect(pidff, slot);
+				if (!restarted++)
+					pidff->restart_us = ktime_us_delta(
+						ktime_get(), start);
+			}
+		}
+	}
+
+	us = ktime_us_delta(ktime_get(), start);
+	pidff->restore_us = us;
+	if (us > pidff->restore_max_us)
+		pidff->restore_max_us = us;
+	pidff->restores++;
+	pidff->restarted += restarted;
+
+	pidff_release_reports(pidff);
+	mutex_unlock(&ff->mutex);
+}
+
+/*
+ * Fetch the pool report and wait for it to be parsed
+ */
+static void pidff_fetch_pool(struct pidff_device *pidff)
+{
+	hid_hw_request(pidff->hid, pidff->reports[PID_POOL],
+			HID_REQ_GET_REPORT);
+	hid_hw_wait(pidff->hid);
+}
+
 /*
  * Test if autocenter modification is using the supported method
  */
@@ -1871,7 +5038,14 @@ static int pidff_check_autocenter(struct pidff_device *pidff,
 	int error;
 	/*struct ff_effect autocenter; */
 
-	if (IS_DEVICE_MANAGED(pidff)) {
+	if (IS_DEVICE_MANAGED(pidff) && pidff->layout_autocenter >= 0) {
+		/* Probed on another device of the model already */
+		if (pidff->layout_autocenter) {
+			pidff_autocenter(pidff, 0xffff);
+			set_bit(FF_AUTOCENTER, dev->ffbit);
+		}
+		hid_dbg(pidff->hid, "autocenter probe skipped\n");
+	} else if (IS_DEVICE_MANAGED(pidff)) {
 		/*
 		* Let's find out if autocenter modification is supported
 		* Specification doesn't specify anything, so we request an
@@ -1880,6 +5054,8 @@ static int pidff_check_autocenter(struct pidff_device *pidff,
 		* effect id is a built-in spring type effect used for autocenter
 		*/
 
+		/* The probe effect does not belong to any slot */
+		pidff->active_effect_id = -1;
 		error = pidff_request_effect_upload(pidff, 1);
 		if (error) {
 			hid_err(pidff->hid, "upload request failed\n");
@@ -1897,6 +5073,8 @@ static int pidff_check_autocenter(struct pidff_device *pidff,
 		}
 
 		pidff_erase_pid(pidff, pidff->active.id);
+		pidff_layout_autocenter(pidff,
+			test_bit(FF_AUTOCENTER, dev->ffbit));
 	}
 
 	/*
@@ -1912,33 +5090,27 @@ static int pidff_check_autocenter(struct pidff_device *pidff,
  */
 static void pidff_init_hw_requests(struct pidff_device *pidff, struct input_dev *dev)
 {
-	int i = 0;
-
-	/* pool report is sometimes messed up, refetch it */
-	hid_hw_request(pidff->hid, pidff->reports[PID_POOL],
-			HID_REQ_GET_REPORT);
-	hid_hw_wait(pidff->hid);
+	ktime_t start;
+	int i;
 
-	if (pidff->pool[PID_SIMULTANEOUS_MAX].value) {
-		while (pidff->pool[PID_SIMULTANEOUS_MAX].value[0] < 2) {
-			if (i++ > 2) {
-				hid_notice(pidff->hid,
-					 "device reports %d simultaneous effects\n",
-					 pidff->pool[PID_SIMULTANEOUS_MAX].value[0]);
-				break;
-			}
-			hid_dbg(pidff->hid, "pid_pool requested again\n");
-			hid_hw_request(pidff->hid, pidff->reports[PID_POOL],
-					  HID_REQ_GET_REPORT);
-			hid_hw_wait(pidff->hid);
-		}
+	/* Independent of the pool, goes out while it is being fetched */
+	if (test_bit(FF_GAIN, dev->ffbit)) {
+		pidff_set(&pidff->device_gain[PID_DEVICE_GAIN_FIELD], 0xffff);
+		hid_hw_request(pidff->hid, pidff->reports[PID_DEVICE_GAIN],
+				     HID_REQ_SET_REPORT);
 	}
 
-	for (i = 0; i < PID_EFFECTS_MAX; i++) {
-		pidff->effect[i].id = -1;
-		pidff->effect[i].offset[0] = NULL;
-		pidff->effect[i].offset[1] = NULL;
-	}
+	start = ktime_get();
+	pidff_fetch_pool(pidff);
+
+	if (pidff->pool[PID_SIMULTANEOUS_MAX].value &&
+	    pidff->pool[PID_SIMULTANEOUS_MAX].value[0] < 2)
+		hid_notice(pidff->hid, "device reports %d simultaneous effects\n",
+			pidff->pool[PID_SIMULTANEOUS_MAX].value[0]);
+
+	for (i = 0; i <= PID_EFFECTS_MAX; i++)
+		pidff->pid_slot[i] = -1;
+	bitmap_zero(pidff->pid_used, PID_EFFECTS_MAX);
 
 	if (pidff->pool[PID_RAM_POOL_SIZE].value &&
 			pidff->pool[PID_RAM_POOL_SIZE].value[0] > 0) {
@@ -1949,6 +5121,11 @@ static void pidff_init_hw_requests(struct pidff_device *pidff, struct input_dev
 				- pidff->block_offset[0].field->logical_minimum
 				+ 1;
 	}
+	if (pidff->pid_total_ram > U16_MAX) {
+		hid_notice(pidff->hid, "using %d of %d bytes device memory\n",
+			U16_MAX, pidff->pid_total_ram);
+		pidff->pid_total_ram = U16_MAX;
+	}
 	hid_dbg(pidff->hid, "device memory size is %d bytes\n",
 			pidff->pid_total_ram);
 
@@ -1972,20 +5149,274 @@ static void pidff_init_hw_requests(struct pidff_device *pidff, struct input_dev
 		clear_bit(PID_SUPPORTS_DEVICE_MANAGED, &pidff->flags);
 	}
 
-	if (pidff->max_effects > PID_EFFECTS_MAX)
-		pidff->max_effects = PID_EFFECTS_MAX;
-
 	if (pidff->pool[PID_SIMULTANEOUS_MAX].value)
 		hid_notice(pidff->hid, "max simultaneous effects is %d\n",
 			pidff->pool[PID_SIMULTANEOUS_MAX].value[0]);
+	pidff->probe_us[PID_PROBE_POOL] = ktime_us_delta(ktime_get(), start);
 
-	if (test_bit(FF_GAIN, dev->ffbit)) {
-		pidff_set(&pidff->device_gain[PID_DEVICE_GAIN_FIELD], 0xffff);
-		hid_hw_request(pidff->hid, pidff->reports[PID_DEVICE_GAIN],
-				     HID_REQ_SET_REPORT);
+	start = ktime_get();
+	pidff_check_autocenter(pidff, dev);
+	pidff->probe_us[PID_PROBE_AUTOCENTER] =
+		ktime_us_delta(ktime_get(), start);
+}
+
+/*
+ * Show driver statistics in debugfs
+ */
+static int pidff_debugfs_show(struct seq_file *m, void *unused)
+{
+	struct pidff_device *pidff = m->private;
+	struct pidff_slab *slab;
+	int i, resident = 0;
+
+	for (i = 0; i < pidff->nr_effects; i++)
+		resident += pidff->effect[i].resident;
+	seq_printf(m, "effects: %d/%d resident, %u swap ins, %u evictions, %u deferred uploads\n",
+		resident, pidff->nr_effects, pidff->swap_ins,
+		pidff->evictions, pidff->deferred_uploads);
+
+	seq_printf(m, "device: %u stop all, %u stops elided\n",
+		pidff->stop_all_sent, pidff->stops_elided);
+	seq_printf(m, "control reports: %u sent, usbhid depth avg %u max %u\n",
+		pidff->control_sent, pidff->control_sent ?
+		pidff->control_depth_sum / pidff->control_sent : 0,
+		pidff->control_depth_max);
+	seq_printf(m, "parameter reports: %u queued, depth max %u, %u overflows, wait avg %lld max %lld us\n",
+		pidff->bulk_queued, pidff->bulk_depth_max,
+		pidff->bulk_overflows, pidff->bulk_queued ?
+		div64_s64(pidff->bulk_wait_sum, pidff->bulk_queued) : 0,
+		pidff->bulk_wait_max);
+
+	if (IS_DEVICE_MANAGED(pidff)) {
+		seq_printf(m, "block load: avg %u us, polls", pidff->block_load_avg_us);
+		for (i = 0; i < PID_BLOCK_LOAD_POLL_BUCKETS; i++)
+			seq_printf(m, " %u", pidff->block_load_polls[i]);
+		seq_puts(m, ", us");
+		for (i = 0; i < PID_BLOCK_LOAD_TIME_BUCKETS - 1; i++)
+			seq_printf(m, " <%u:%u", 250U << i,
+				pidff->block_load_us[i]);
+		seq_printf(m, " >=%u:%u", 250U << (i - 1),
+			pidff->block_load_us[i]);
+		seq_puts(m, "\n");
 	}
 
-	pidff_check_autocenter(pidff, dev);
+	if (pidff_async)
+		seq_printf(m, "async: %u uploads\n", pidff->async_uploads);
+
+	seq_printf(m, "tombstones: %u revived\n", pidff->revived);
+	seq_printf(m, "images: %u effects restored\n", pidff->image_restores);
+	seq_printf(m, "restore: %u times, %u effects, %u restarted, %u failed, last %lld us, max %lld us, first restart %lld us\n",
+		pidff->restores, pidff->restored, pidff->restarted,
+		pidff->restore_failures, pidff->restore_us,
+		pidff->restore_max_us, pidff->restart_us);
+	seq_printf(m, "layout cache: %u hits, %u misses\n",
+		pidff_layout_hits, pidff_layout_misses);
+	seq_puts(m, "probe:");
+	for (i = 0; i < PID_PROBE_STEPS; i++)
+		seq_printf(m, " %s %lld us", pidff_probe_steps[i],
+			pidff->probe_us[i]);
+	seq_puts(m, "\n");
+
+	if (IS_DEVICE_MANAGED(pidff))
+		seq_printf(m, "erases: %u deferred, freed in %u batches\n",
+			pidff->deferred_erases, pidff->erase_batches);
+
+	seq_printf(m, "updates: %u held back, %u coalesced, %u single report\n",
+		pidff->deferred_updates, pidff->coalesced_updates,
+		pidff->fast_updates);
+
+	if (pidff_stream)
+		seq_printf(m, "stream: %u us interval, %u frames, %u skipped, jitter avg %lld max %lld us\n",
+			(unsigned int)ktime_to_us(pidff->stream_period),
+			pidff->stream_frames, pidff->stream_skipped,
+			pidff->stream_frames ? div64_s64(
+			pidff->stream_jitter_sum, pidff->stream_frames) /
+			NSEC_PER_USEC : 0,
+			pidff->stream_jitter_max / NSEC_PER_USEC);
+
+	seq_puts(m, "elided reports:");
+	for (i = 0; i < sizeof(pidff_reports); i++)
+		if (pidff->shadow[i].nr_keys)
+			seq_printf(m, " 0x%02x %u", pidff_reports[i],
+				pidff->shadow[i].elided);
+	seq_puts(m, "\n");
+
+	if (!IS_DEVICE_MANAGED(pidff)) {
+		seq_printf(m, "pool: %u/%u bytes used, start 0x%x, largest free %u\n",
+			pidff->pid_used_ram, pidff->pid_total_ram,
+			pidff->pool_head.block_offset,
+			pidff->memory_by_offset.rb_node ?
+			rb_entry(pidff->memory_by_offset.rb_node,
+				struct pidff_memory_block,
+				offset_node)->subtree_gap : 0);
+
+		for (i = 0; i < PID_SLAB_CLASSES; i++) {
+			slab = &pidff->slab[i];
+			seq_printf(m, "slab %s: %u bytes, %u regions, %u/%u slots used, %u spilled\n",
+				pidff_slab_names[i],
+				pidff_align(pidff, pidff->report_size[
+					PID_SET_ENVELOPE + i]),
+				slab->nr_regions, slab->slots_used,
+				slab->nr_regions * PID_SLAB_SLOTS,
+				slab->spilled);
+		}
+
+		seq_printf(m, "shared blocks: %u uploads avoided\n",
+			pidff->shared_hits);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pidff_debugfs);
+
+/*
+ * Run the stream timer at the polling interval of the output endpoint
+ */
+static void pidff_stream_init(struct pidff_device *pidff)
+{
+	struct usbhid_device *usbhid = pidff->hid->driver_data;
+	struct urb *urb = usbhid->urbout;
+	unsigned int us = 1000;
+
+	/* Without an output endpoint reports go out as control transfers */
+	if (urb)
+		us = urb->interval *
+			(urb->dev->speed >= USB_SPEED_HIGH ? 125 : 1000);
+
+	pidff->stream_period = ns_to_ktime((u64)us * NSEC_PER_USEC);
+	hid_dbg(pidff->hid, "streaming every %u us\n", us);
+}
+
+/*
+ * Set up the shadows of the reports which are resent with unchanged values
+ */
+static int pidff_alloc_shadows(struct pidff_device *pidff)
+{
+	unsigned int nr_keys;
+	int i, error;
+
+	error = pidff_shadow_alloc(pidff, PID_SET_EFFECT, PID_EFFECTS_MAX + 1);
+	if (error)
+		return error;
+
+	error = pidff_shadow_alloc(pidff, PID_DEVICE_GAIN, 1);
+	if (error)
+		return error;
+
+	/* Parameter blocks are per effect and axis, or per arena block */
+	nr_keys = IS_DEVICE_MANAGED(pidff) ?
+		(PID_EFFECTS_MAX + 1) * PID_AXES_MAX : pidff->nr_blocks;
+	for (i = PID_SET_ENVELOPE; i <= PID_SET_RAMP; i++) {
+		error = pidff_shadow_alloc(pidff, i, nr_keys);
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+
+/*
+ * Set up the queue of waiting output reports
+ */
+static int pidff_alloc_sched(struct pidff_device *pidff)
+{
+	struct hid_report *report;
+	unsigned int nr_values;
+	int i, j;
+
+	/* Sized for any report, whatever type the device gave it */
+	for (i = 0; i < sizeof(pidff_reports); i++) {
+		report = pidff->reports[i];
+		if (!report)
+			continue;
+
+		nr_values = 0;
+		for (j = 0; j < report->maxfield; j++)
+			nr_values += report->field[j]->report_count;
+		pidff->sched_nr_values = max(pidff->sched_nr_values,
+			nr_values);
+	}
+
+	/* One more slot to keep the report fields in while sending */
+	pidff->sched_values = kcalloc((PID_SCHED_SIZE + 1) *
+		pidff->sched_nr_values,
+		sizeof(*pidff->sched_values), GFP_KERNEL);
+	pidff->sched = kcalloc(PID_SCHED_SIZE, sizeof(*pidff->sched),
+		GFP_KERNEL);
+	if (!pidff->sched || !pidff->sched_values) {
+		kfree(pidff->sched);
+		pidff->sched = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Set up the debugfs files of a device. They live in a directory of their
+ * own rather than in the HID debug directory, which goes away at disconnect
+ * while the pidff_device may stay until the input device is released.
+ */
+static void pidff_debugfs_init(struct pidff_device *pidff)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "hid-pidff-%s", dev_name(&pidff->hid->dev));
+	pidff->debugfs = debugfs_create_dir(name, NULL);
+	pidff->debugfs_stats = debugfs_create_file("pidff", 0444,
+		pidff->debugfs, pidff, &pidff_debugfs_fops);
+}
+
+/*
+ * Remove the debugfs files, waiting for readers and writers still in them
+ */
+static void pidff_debugfs_remove(struct pidff_device *pidff)
+{
+	debugfs_remove_recursive(pidff->debugfs);
+	pidff->debugfs = NULL;
+	pidff->debugfs_stats = NULL;
+}
+
+/*
+ * Release everything allocated for a device but the pidff_device itself
+ */
+static void pidff_release(struct pidff_device *pidff)
+{
+	pidff_debugfs_remove(pidff);
+
+	hrtimer_cancel(&pidff->stream_timer);
+	if (pidff->wq) {
+		cancel_work_sync(&pidff->swap_work);
+		cancel_delayed_work_sync(&pidff->erase_work);
+		cancel_delayed_work_sync(&pidff->update_work);
+		cancel_delayed_work_sync(&pidff->sched_work);
+		destroy_workqueue(pidff->wq);
+		pidff->wq = NULL;
+	}
+	pidff_shadow_free(pidff);
+	kfree(pidff->sched);
+	kfree(pidff->sched_values);
+	kfree(pidff->images);
+	pidff->sched = NULL;
+	pidff->sched_values = NULL;
+	pidff->images = NULL;
+	kfree(pidff->effect);
+	pidff->effect = NULL;
+	pidff->nr_effects = 0;
+
+	kfree(pidff->blocks);
+	kfree(pidff->free_blocks);
+	pidff->blocks = NULL;
+	pidff->free_blocks = NULL;
+	pidff->nr_blocks = 0;
+}
+
+/*
+ * ff_device destroy() handler, the pidff_device is freed by the input core
+ */
+static void pidff_destroy(struct ff_device *ff)
+{
+	pidff_release(ff->private);
 }
 
 /*
@@ -1998,7 +5429,9 @@ int hid_pidff_init(struct hid_device *hid)
 						struct hid_input, list);
 	struct input_dev *dev = hidinput->input;
 	struct ff_device *ff;
-	int error;
+	ktime_t start;
+	s64 probe_us = 0;
+	int error, i;
 
 	hid_dbg(hid, "starting pid init\n");
 
@@ -2011,32 +5444,64 @@ int hid_pidff_init(struct hid_device *hid)
 	if (!pidff)
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&pidff->memory);
+	pidff->wq = alloc_ordered_workqueue("pidff", 0);
+	if (!pidff->wq) {
+		kfree(pidff);
+		return -ENOMEM;
+	}
+
+	pidff_init_memory(pidff);
+	spin_lock_init(&pidff->lock);
+	spin_lock_init(&pidff->sched_lock);
+	pidff->image_slot = -1;
+	INIT_DELAYED_WORK(&pidff->sched_work, pidff_sched_work);
+	INIT_WORK(&pidff->swap_work, pidff_swap_work);
+	INIT_DELAYED_WORK(&pidff->erase_work, pidff_erase_work);
+	INIT_DELAYED_WORK(&pidff->update_work, pidff_update_work);
+	hrtimer_init(&pidff->stream_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	pidff->stream_timer.function = pidff_stream_timer;
 
 	pidff->hid = hid;
+	pidff->input = dev;
 	pidff->flags = 0xff;	/* Check support later */
 	pidff->active.id = 0;
+	pidff->layout_autocenter = -1;
 
 	hid_device_io_start(hid);
 
-	pidff_find_reports(hid, HID_OUTPUT_REPORT, pidff);
-	pidff_find_reports(hid, HID_FEATURE_REPORT, pidff);
+	start = ktime_get();
+	if (pidff_layout_load(pidff, dev)) {
+		pidff_find_reports(hid, HID_OUTPUT_REPORT, pidff);
+		pidff_find_reports(hid, HID_FEATURE_REPORT, pidff);
 
-	if (!pidff_reports_ok(pidff)) {
-		hid_dbg(hid, "reports not ok, aborting\n");
-		error = -ENODEV;
-		goto fail;
-	}
+		if (!pidff_reports_ok(pidff)) {
+			hid_dbg(hid, "reports not ok, aborting\n");
+			error = -ENODEV;
+			goto fail;
+		}
 
-	error = pidff_init_fields(pidff, dev);
-	if (error)
-		goto fail;
+		error = pidff_init_fields(pidff, dev);
+		if (error)
+			goto fail;
+
+		pidff_layout_save(pidff, dev);
+	}
+	pidff->probe_us[PID_PROBE_LAYOUT] = ktime_us_delta(ktime_get(), start);
 
+	start = ktime_get();
 	pidff_reset(pidff);
+	pidff->probe_us[PID_PROBE_RESET] = ktime_us_delta(ktime_get(), start);
 
 	/* Do the initialization part which requires hw requests */
 	pidff_init_hw_requests(pidff, dev);
 
+	for (i = 0; i < PID_PROBE_STEPS; i++) {
+		hid_dbg(hid, "probe %s took %lld us\n", pidff_probe_steps[i],
+			pidff->probe_us[i]);
+		probe_us += pidff->probe_us[i];
+	}
+	hid_info(hid, "pid probe took %lld us\n", probe_us);
+
 	/* Determine max effects, this one should work with device managed devices */
 	if (pidff->block_load[PID_EFFECT_BLOCK_INDEX].field) {
 		pidff->max_effects =
@@ -2053,9 +5518,48 @@ int hid_pidff_init(struct hid_device *hid)
 			pidff->set_effect[PID_EFFECT_BLOCK_INDEX].field->logical_minimum +
 				1;
 	}
+	if (pidff->max_effects > PID_EFFECTS_MAX)
+		pidff->max_effects = PID_EFFECTS_MAX;
 	hid_dbg(pidff->hid, "device max effects %d\n", pidff->max_effects);
 
-	error = input_ff_create(dev, pidff->max_effects);
+	/* Offer more effects than the device has slots if asked to */
+	pidff->nr_effects = max_t(int, pidff->max_effects,
+		min_t(unsigned int, pidff_virtual_effects, FF_MAX_EFFECTS));
+	pidff->effect = kcalloc(pidff->nr_effects, sizeof(*pidff->effect),
+		GFP_KERNEL);
+	if (!pidff->effect) {
+		error = -ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < pidff->nr_effects; i++)
+		pidff->effect[i].id = -1;
+	if (pidff->nr_effects > pidff->max_effects)
+		hid_dbg(pidff->hid, "%d virtual effects\n", pidff->nr_effects);
+
+	/* Pool layout depends on the maximum amount of effects */
+	if (!IS_DEVICE_MANAGED(pidff)) {
+		error = pidff_alloc_blocks(pidff);
+		if (error)
+			goto fail;
+		pidff_init_memory(pidff);
+	}
+
+	error = pidff_alloc_shadows(pidff);
+	if (error)
+		goto fail;
+
+	error = pidff_alloc_sched(pidff);
+	if (error)
+		goto fail;
+
+	error = pidff_alloc_images(pidff);
+	if (error)
+		goto fail;
+
+	if (pidff_stream)
+		pidff_stream_init(pidff);
+
+	error = input_ff_create(dev, pidff->nr_effects);
 	if (error)
 		goto fail;
 
@@ -2066,6 +5570,15 @@ int hid_pidff_init(struct hid_device *hid)
 	ff->set_gain = pidff_set_gain;
 	ff->set_autocenter = pidff_set_autocenter;
 	ff->playback = pidff_playback;
+	ff->destroy = pidff_destroy;
+
+	/* Closing clients stop their effects at once when they can */
+	if (pidff->control_id[PID_STOP_ALL_EFFECTS]) {
+		pidff->flush = dev->flush;
+		dev->flush = pidff_flush;
+	}
+
+	pidff_debugfs_init(pidff);
 
 	hid_info(dev, "Force feedback for USB HID PID devices by Anssi Hannula <anssi.hannula@gmail.com>\n");
 
@@ -2074,24 +5587,80 @@ int hid_pidff_init(struct hid_device *hid)
 	return 0;
 
  fail:
-	pidff_empty_memory(pidff);
 	hid_device_io_stop(hid);
 
+	pidff_release(pidff);
 	kfree(pidff);
 	return error;
 }
 
 /*
- * Remove any allocated memory (for driver managed mode)
+ * Stop talking to the device and remove any allocated memory (for driver
+ * managed mode). For usbhid to call at disconnect, before it frees its
+ * state: the pidff_device itself lives on until the input device is
+ * released, which an open file can put off.
  */
 void hid_pidff_destroy(struct hid_device *hid)
 {
-	struct hid_input *hidinput = list_entry(hid->inputs.next,
-			struct hid_input, list);
-	struct input_dev *dev = hidinput->input;
-	struct pidff_device *pidff = dev->ff->private;
+	struct hid_input *hidinput;
+	struct input_dev *dev;
+	struct pidff_device *pidff;
+	struct ff_device *ff;
+	unsigned long flags;
+
+	if (list_empty(&hid->inputs))
+		return;
 
-	if (pidff)
-		pidff_empty_memory(pidff);
+	hidinput = list_entry(hid->inputs.next, struct hid_input, list);
+	dev = hidinput->input;
+	ff = dev->ff;
+	if (!ff || ff->destroy != pidff_destroy)
+		return;
+	pidff = ff->private;
+
+	/* Nothing gets queued or sent once this is seen under any lock */
+	mutex_lock(&ff->mutex);
+	spin_lock_irqsave(&pidff->lock, flags);
+	spin_lock(&pidff->sched_lock);
+	pidff->dead = 1;
+	spin_unlock(&pidff->sched_lock);
+	spin_unlock_irqrestore(&pidff->lock, flags);
+	mutex_unlock(&ff->mutex);
+
+	/* Nothing reaches the device through debugfs from now on */
+	pidff_debugfs_remove(pidff);
+
+	/* The works take the ff mutex, so it is not held here */
+	hrtimer_cancel(&pidff->stream_timer);
+	cancel_work_sync(&pidff->swap_work);
+	cancel_delayed_work_sync(&pidff->erase_work);
+	cancel_delayed_work_sync(&pidff->update_work);
+	cancel_delayed_work_sync(&pidff->sched_work);
+	destroy_workqueue(pidff->wq);
+	pidff->wq = NULL;
+
+	mutex_lock(&ff->mutex);
+	pidff_empty_memory(pidff);
+	mutex_unlock(&ff->mutex);
 }
 
+/*
+ * Load the effects again after the device lost them. For usbhid to call
+ * from its resume and post_reset handlers.
+ */
+int hid_pidff_restore(struct hid_device *hid)
+{
+	struct hid_input *hidinput;
+	struct input_dev *dev;
+
+	if (list_empty(&hid->inputs))
+		return -ENODEV;
+
+	hidinput = list_entry(hid->inputs.next, struct hid_input, list);
+	dev = hidinput->input;
+	if (!dev->ff || dev->ff->destroy != pidff_destroy)
+		return -ENODEV;
+
+	pidff_restore(dev->ff->private);
+	return 0;
+}